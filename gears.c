@@ -7,18 +7,32 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stddef.h>
 #include <glad/gl.h>
 #define GLFW_INCLUDE_NONE
 #include <GLFW/glfw3.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include <tinycthread.h>
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include <stb_image_write.h>
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define GEARS_SSE 1
+#endif
+#if defined(__AVX__)
+#include <immintrin.h>
+#define GEARS_AVX 1
+#endif
 
-static double matAlpha = 0.0;
 static double timeOffset;
 static double view_rotx = 0.0, view_roty = 0.0, view_rotz = 0.0;
-static double sceneAngle = 0.0;
 static double camDip = 0.0;
-static double sunAngle2 = 0.0;
-static double sunAngle3 = 0.0;
 static double range = 0.0;
 static double camHeight = 0.5;
 static double floorOffset = 0.0;
@@ -34,6 +48,7 @@ static int yCursor = 0;
 static int animPeriod = 3;
 static int animIndex = 0;
 static double mobileSpeed = 3.0;
+static int useCore = 0; /* 3.3 core context and GLSL renderer, -core */
 
 // Business logic parameters
 static int FAST = 0; // Fast rate of mobile shape change
@@ -43,21 +58,114 @@ static double VENUS2;
 static int WARM = 0; // warm up the circuits
 static double WARM2;
 
+/* Animation timeline.  tlAdvance() evaluates every animated channel
+   once per frame into snapshot, and the draw code reads that frame only
+   through the const frame pointer.  The clock follows glfwGetTime()
+   unless tlFixed is set, in which case each frame moves tlTime forward
+   by exactly tlDt; tlSeek() jumps to an arbitrary time in either mode. */
+typedef struct gearsFrame {
+    long index; /* frames since start */
+    double time; /* timeline seconds, timeOffset included */
+    double channel[5]; /* gearsChannel() at time */
+    double matAlpha;
+    double FAST2;
+    double VENUS2;
+    double WARM2;
+    int cones; /* cones per Sol, from WARM2 */
+    double solscale; /* Sol size, from FAST2 */
+    double sceneAngle;
+    double sunAngle2;
+    double sunAngle3;
+    double waveInner; /* mobile wave offsets */
+    double waveOuter;
+    GLfloat lightpos[4];
+    int xCursor;
+    int yCursor;
+} gearsFrame;
+
+static gearsFrame snapshot;
+static const gearsFrame * frame = & snapshot;
+static int tlFixed = 0;
+static double tlDt = 1.0 / 60.0;
+static double tlTime = 0.0; /* time of the next frame when tlFixed */
+
+/* Frame statistics.  Every frame accumulates CPU time per phase and
+   what it submitted to GL into stats; statsEnd() files the frame into
+   a ring of the last STATS_FRAMES frames, which feeds the HUD overlay
+   (key P) and, while recording (key C), a CSV log. */
+#define STATS_FRAMES 240
+#define PHASE_ANIMATE 0
+#define PHASE_DRAW1 1
+#define PHASE_DRAW2 2 /* scene traversal and Sol gathering */
+#define PHASE_MIRROR 3 /* drawing every mirror variant */
+#define PHASE_SWAP 4
+#define PHASES 5
+typedef struct frameStats {
+    double frameTime; /* swap to swap */
+    double phase[PHASES];
+    long vertices;
+    long triangles;
+    long drawCalls;
+    long glCalls;
+    long materialsElided; /* gearMaterial() calls that changed nothing */
+    long culled; /* Sols and batch runs outside the frustum */
+} frameStats;
+
+static frameStats stats; /* the frame being measured */
+static frameStats statsRing[STATS_FRAMES];
+static long statsCount = 0;
+static double statsMark = 0.0;
+static double statsSwap = -1.0;
+static int statsOverlay = 0;
+static FILE * statsCsv = NULL;
+static double paceRate; /* the pacing target, defined with the pacing below */
+#define STATS_CSV_FILENAME "gears_stats.csv"
+
+/* charge the time since the last mark to phase p */
+static void statsPhase(int p) {
+    double now = glfwGetTime();
+    stats.phase[p] += now - statsMark;
+    statsMark = now;
+}
+
+/* GL calls are counted where they are made: STATS_CALL() wraps every GL
+   call made while animating and drawing a frame, STATS_DRAW() a draw call
+   submitting verts vertices.  The -export readback is not counted. */
+#define STATS_CALL(call) (stats.glCalls += 1, call)
+#define STATS_DRAW(verts,call) (stats.glCalls += 1, stats.drawCalls += 1, \
+    stats.vertices += (verts), call)
+
+/* what the last gearMaterial() call set; colors live in static arrays
+   or the material table, so the pointer identifies the color */
+static const GLfloat * materialColor = NULL;
+static GLenum materialFace = 0;
+static double materialAlpha = -1.0;
+
 void gearMaterial(GLenum f,const GLfloat * ps) {
+    if (useCore) {
+        return;
+    }
+    if (ps == materialColor && f == materialFace && frame->matAlpha == materialAlpha) {
+        stats.materialsElided += 1;
+        return;
+    }
+    materialColor = ps;
+    materialFace = f;
+    materialAlpha = frame->matAlpha;
     GLfloat rrs[4];
     rrs[0] = 2 * ps[0] / 5;
     rrs[1] = 2 * ps[1] / 5;
     rrs[2] = 2 * ps[2] / 5;
-    rrs[3] = matAlpha;
+    rrs[3] = frame->matAlpha;
     GLfloat hatps[4];
     hatps[0] = ps[0];
     hatps[1] = ps[1];
     hatps[2] = ps[2];
-    hatps[3] = matAlpha;
-    glMaterialfv(f,GL_SPECULAR,hatps);
-    glMaterialfv(f,GL_DIFFUSE,rrs);
+    hatps[3] = frame->matAlpha;
+    STATS_CALL(glMaterialfv(f,GL_SPECULAR,hatps));
+    STATS_CALL(glMaterialfv(f,GL_DIFFUSE,rrs));
     GLfloat s[] = {50.0};
-    glMaterialfv(f,GL_SHININESS,s);
+    STATS_CALL(glMaterialfv(f,GL_SHININESS,s));
 }
 
 //
@@ -67,8 +175,8 @@ void gearMaterial(GLenum f,const GLfloat * ps) {
 // 3 : mobile param 3 (parameter for outer mobiles)
 // 4 : mobile param 4 (wave)
 //
-double gearsGetTime(int lighting) {
-    double f = (timeOffset + glfwGetTime());
+static double gearsChannel(double t, int lighting) {
+    double f = t;
     double m = FAST2 >= 0.5 ? 4.0 : 0.25;
     // f *= m;
     // f = 3.0 * f + 2.5/2.0 * ( 40.5 * sin(f / 81.0) + 4.5 * sin(f / 9.0) + 1.5 * sin(f / 3.0) + 0.5 * sin(f) );
@@ -95,81 +203,525 @@ double gearsGetTime(int lighting) {
     }
 }
 
-/* Calculate the cross product */
-static void calcCross(double * c1, double * c2, double * c3,
-        double a1, double a2, double a3,
-        double b1, double b2, double b3) {
-    * c1 = a2 * b3 - a3 * b2;
-    * c2 = a3 * b1 - a1 * b3;
-    * c3 = a1 * b2 - a2 * b1;
-}
-
-/* Normalize a vector in place */
-static void normVec(double * a1, double * a2, double * a3) {
-    double d = sqrt(* a1 * * a1 + * a2 * * a2 + * a3 * * a3);
-    * a1 /= d;
-    * a2 /= d;
-    * a3 /= d;
-}
-
-typedef struct tnrec {
-    double d[3];
-    double a[3];
-    double b[3];
-    double c[3];
-} tnrec;
-
-/* Calculate the normal vector for a triangle with vertices
-   at a,b,c */
-static void triNormc(tnrec * x,
-        double a1, double a2, double a3,
-        double b1, double b2, double b3,
-        double c1, double c2, double c3) {
-    double d1,d2,d3;
-    double v1,v2,v3,w1,w2,w3;
-    v1 = b1 - a1; v2 = b2 - a2; v3 = b3 - a3;
-    w1 = c1 - a1; w2 = c2 - a2; w3 = c3 - a3;
-    calcCross(&d1,&d2,&d3,v1,v2,v3,w1,w2,w3);
-    normVec(&d1,&d2,&d3);
-    x->d[0] = d1; x->d[1] = d2; x->d[2] = d3;
-    x->a[0] = a1; x->a[1] = a2; x->a[2] = a3;
-    x->b[0] = b1; x->b[1] = b2; x->b[2] = b3;
-    x->c[0] = c1; x->c[1] = c2; x->c[2] = c3;
-}
-
-static int flipWorld = 0;
-
-static void triNormd(tnrec * x) {
-    if (flipWorld) {
-        glNormal3f(- x->d[0],- x->d[1],- x->d[2]);
+/* 4x4 column-major float matrices, post-multiplied like the GL matrix
+   stack: mat4Mul(a,b) replaces a with a * b.  The column operations use
+   SSE when the compiler targets it. */
+static void mat4Identity(GLfloat * m) {
+    int i;
+    for (i = 0; i < 16; i += 1) {
+        m[i] = (i % 5 == 0) ? 1.0f : 0.0f;
+    }
+}
+
+static void mat4Mul(GLfloat * a, const GLfloat * b) {
+#if GEARS_SSE
+    __m128 c0 = _mm_loadu_ps(a + 0);
+    __m128 c1 = _mm_loadu_ps(a + 4);
+    __m128 c2 = _mm_loadu_ps(a + 8);
+    __m128 c3 = _mm_loadu_ps(a + 12);
+    __m128 r[4];
+    int j;
+    for (j = 0; j < 4; j += 1) {
+        r[j] = _mm_add_ps(
+            _mm_add_ps(_mm_mul_ps(c0,_mm_set1_ps(b[4 * j + 0])),
+                       _mm_mul_ps(c1,_mm_set1_ps(b[4 * j + 1]))),
+            _mm_add_ps(_mm_mul_ps(c2,_mm_set1_ps(b[4 * j + 2])),
+                       _mm_mul_ps(c3,_mm_set1_ps(b[4 * j + 3]))));
+    }
+    for (j = 0; j < 4; j += 1) {
+        _mm_storeu_ps(a + 4 * j,r[j]);
+    }
+#else
+    GLfloat r[16];
+    int i,j;
+    for (j = 0; j < 4; j += 1) {
+        for (i = 0; i < 4; i += 1) {
+            r[4 * j + i] = a[i] * b[4 * j] + a[4 + i] * b[4 * j + 1] +
+                a[8 + i] * b[4 * j + 2] + a[12 + i] * b[4 * j + 3];
+        }
+    }
+    memcpy(a,r,sizeof(r));
+#endif
+}
+
+static void mat4Translate(GLfloat * m, double x, double y, double z) {
+#if GEARS_SSE
+    __m128 t = _mm_add_ps(
+        _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(m + 0),_mm_set1_ps(x)),
+                   _mm_mul_ps(_mm_loadu_ps(m + 4),_mm_set1_ps(y))),
+        _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(m + 8),_mm_set1_ps(z)),
+                   _mm_loadu_ps(m + 12)));
+    _mm_storeu_ps(m + 12,t);
+#else
+    int i;
+    for (i = 0; i < 4; i += 1) {
+        m[12 + i] += m[i] * x + m[4 + i] * y + m[8 + i] * z;
+    }
+#endif
+}
+
+static void mat4Scale(GLfloat * m, double x, double y, double z) {
+#if GEARS_SSE
+    _mm_storeu_ps(m + 0,_mm_mul_ps(_mm_loadu_ps(m + 0),_mm_set1_ps(x)));
+    _mm_storeu_ps(m + 4,_mm_mul_ps(_mm_loadu_ps(m + 4),_mm_set1_ps(y)));
+    _mm_storeu_ps(m + 8,_mm_mul_ps(_mm_loadu_ps(m + 8),_mm_set1_ps(z)));
+#else
+    int i;
+    for (i = 0; i < 4; i += 1) {
+        m[i] *= x;
+        m[4 + i] *= y;
+        m[8 + i] *= z;
+    }
+#endif
+}
+
+/* same convention as glRotate: angle in degrees about (x,y,z) */
+static void mat4Rotate(GLfloat * m, double angle, double x, double y, double z) {
+    double mag = sqrt(x * x + y * y + z * z);
+    double a = angle * M_PI / 180.0;
+    double c = cos(a);
+    double s = sin(a);
+    GLfloat r[16];
+    if (mag == 0.0) {
+        return;
+    }
+    x /= mag; y /= mag; z /= mag;
+    mat4Identity(r);
+    r[0] = x * x * (1 - c) + c;
+    r[1] = y * x * (1 - c) + z * s;
+    r[2] = x * z * (1 - c) - y * s;
+    r[4] = x * y * (1 - c) - z * s;
+    r[5] = y * y * (1 - c) + c;
+    r[6] = y * z * (1 - c) + x * s;
+    r[8] = x * z * (1 - c) + y * s;
+    r[9] = y * z * (1 - c) - x * s;
+    r[10] = z * z * (1 - c) + c;
+    mat4Mul(m,r);
+}
+
+/* m = m * glFrustum(l,r,b,t,n,f) */
+static void mat4Frustum(GLfloat * m, double l, double r, double b, double t,
+        double n, double f) {
+    GLfloat p[16];
+    int i;
+    for (i = 0; i < 16; i += 1) {
+        p[i] = 0.0f;
+    }
+    p[0] = 2.0 * n / (r - l);
+    p[5] = 2.0 * n / (t - b);
+    p[8] = (r + l) / (r - l);
+    p[9] = (t + b) / (t - b);
+    p[10] = -(f + n) / (f - n);
+    p[11] = -1.0f;
+    p[14] = -2.0 * f * n / (f - n);
+    mat4Mul(m,p);
+}
+
+/* Frustum culling.  reshape() extracts the six planes of the projection
+   into eye space, normalized so that a plane evaluated at a point is
+   its signed distance.  The frustum is symmetric in x and y, so what
+   one mirror variant culls the others cull too. */
+static GLfloat frustum[6][4];
+
+static void frustumPlanes(const GLfloat * p) {
+    int i,j;
+    for (i = 0; i < 6; i += 1) {
+        int row = i / 2;
+        GLfloat sign = i % 2 ? -1.0 : 1.0;
+        GLfloat d = 0.0;
+        for (j = 0; j < 4; j += 1) {
+            frustum[i][j] = p[4 * j + 3] + sign * p[4 * j + row];
+        }
+        d = sqrt(frustum[i][0] * frustum[i][0] + frustum[i][1] * frustum[i][1] +
+            frustum[i][2] * frustum[i][2]);
+        for (j = 0; j < 4; j += 1) {
+            frustum[i][j] /= d;
+        }
+    }
+}
+
+/* is any of the sphere at eye-space c with radius r inside the frustum? */
+static int sphereVisible(const GLfloat * c, double r) {
+    int i;
+    for (i = 0; i < 6; i += 1) {
+        if (frustum[i][0] * c[0] + frustum[i][1] * c[1] + frustum[i][2] * c[2] +
+                frustum[i][3] < -r) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* q = the point p transformed by m */
+static void mat4Point(GLfloat * q, const GLfloat * m, const GLfloat * p) {
+    int i;
+    for (i = 0; i < 3; i += 1) {
+        q[i] = m[i] * p[0] + m[4 + i] * p[1] + m[8 + i] * p[2] + m[12 + i];
+    }
+}
+
+/* CPU modelview stack for the scene traversal.  It mirrors the GL calls
+   it replaces; GL only sees the composed matrices at draw time. */
+#define MS_DEPTH 8
+static GLfloat msStack[MS_DEPTH][16];
+static int msDepth = 0;
+
+static GLfloat * msTop(void) {
+    return msStack[msDepth];
+}
+
+static void msLoadIdentity(void) {
+    mat4Identity(msStack[msDepth]);
+}
+
+static void msPushMatrix(void) {
+    if (msDepth + 1 >= MS_DEPTH) {
+        fprintf(stderr,"matrix stack overflow\n");
+        exit( EXIT_FAILURE );
+    }
+    memcpy(msStack[msDepth + 1],msStack[msDepth],sizeof(msStack[0]));
+    msDepth += 1;
+}
+
+static void msPopMatrix(void) {
+    if (msDepth > 0) {
+        msDepth -= 1;
+    }
+}
+
+static void msRotatef(double angle, double x, double y, double z) {
+    mat4Rotate(msTop(),angle,x,y,z);
+}
+
+static void msTranslatef(double x, double y, double z) {
+    mat4Translate(msTop(),x,y,z);
+}
+
+/* Triangle geometry in float structure-of-arrays form.  Triangles are
+   recorded with triPush(), then triNormals() computes the face normals
+   of the whole set at once, eight or four triangles per step when the
+   compiler targets AVX or SSE, and triEmit() writes them out as
+   interleaved vertices ready for a vertex buffer. */
+typedef struct triSoA {
+    GLfloat * v[9]; /* ax ay az bx by bz cx cy cz */
+    GLfloat * n[3];
+    int count;
+    int alloc;
+} triSoA;
+
+static void triPush(triSoA * t,
+        GLfloat a1, GLfloat a2, GLfloat a3,
+        GLfloat b1, GLfloat b2, GLfloat b3,
+        GLfloat c1, GLfloat c2, GLfloat c3) {
+    int i;
+    if (t->count == t->alloc) {
+        t->alloc = t->alloc ? 2 * t->alloc : 256;
+        for (i = 0; i < 9; i += 1) {
+            t->v[i] = realloc(t->v[i],sizeof(GLfloat) * t->alloc);
+        }
+        for (i = 0; i < 3; i += 1) {
+            t->n[i] = realloc(t->n[i],sizeof(GLfloat) * t->alloc);
+        }
+    }
+    i = t->count;
+    t->v[0][i] = a1; t->v[1][i] = a2; t->v[2][i] = a3;
+    t->v[3][i] = b1; t->v[4][i] = b2; t->v[5][i] = b3;
+    t->v[6][i] = c1; t->v[7][i] = c2; t->v[8][i] = c3;
+    t->count += 1;
+}
+
+/* unit normal of (b - a) x (c - a) for every triangle of t */
+static void triNormals(triSoA * t) {
+    GLfloat * const * v = t->v;
+    int i = 0;
+#if GEARS_AVX
+    for (; i + 8 <= t->count; i += 8) {
+        __m256 ax = _mm256_loadu_ps(v[0] + i);
+        __m256 ay = _mm256_loadu_ps(v[1] + i);
+        __m256 az = _mm256_loadu_ps(v[2] + i);
+        __m256 ux = _mm256_sub_ps(_mm256_loadu_ps(v[3] + i),ax);
+        __m256 uy = _mm256_sub_ps(_mm256_loadu_ps(v[4] + i),ay);
+        __m256 uz = _mm256_sub_ps(_mm256_loadu_ps(v[5] + i),az);
+        __m256 wx = _mm256_sub_ps(_mm256_loadu_ps(v[6] + i),ax);
+        __m256 wy = _mm256_sub_ps(_mm256_loadu_ps(v[7] + i),ay);
+        __m256 wz = _mm256_sub_ps(_mm256_loadu_ps(v[8] + i),az);
+        __m256 nx = _mm256_sub_ps(_mm256_mul_ps(uy,wz),_mm256_mul_ps(uz,wy));
+        __m256 ny = _mm256_sub_ps(_mm256_mul_ps(uz,wx),_mm256_mul_ps(ux,wz));
+        __m256 nz = _mm256_sub_ps(_mm256_mul_ps(ux,wy),_mm256_mul_ps(uy,wx));
+        __m256 d = _mm256_sqrt_ps(_mm256_add_ps(
+            _mm256_add_ps(_mm256_mul_ps(nx,nx),_mm256_mul_ps(ny,ny)),
+            _mm256_mul_ps(nz,nz)));
+        _mm256_storeu_ps(t->n[0] + i,_mm256_div_ps(nx,d));
+        _mm256_storeu_ps(t->n[1] + i,_mm256_div_ps(ny,d));
+        _mm256_storeu_ps(t->n[2] + i,_mm256_div_ps(nz,d));
+    }
+#endif
+#if GEARS_SSE
+    for (; i + 4 <= t->count; i += 4) {
+        __m128 ax = _mm_loadu_ps(v[0] + i);
+        __m128 ay = _mm_loadu_ps(v[1] + i);
+        __m128 az = _mm_loadu_ps(v[2] + i);
+        __m128 ux = _mm_sub_ps(_mm_loadu_ps(v[3] + i),ax);
+        __m128 uy = _mm_sub_ps(_mm_loadu_ps(v[4] + i),ay);
+        __m128 uz = _mm_sub_ps(_mm_loadu_ps(v[5] + i),az);
+        __m128 wx = _mm_sub_ps(_mm_loadu_ps(v[6] + i),ax);
+        __m128 wy = _mm_sub_ps(_mm_loadu_ps(v[7] + i),ay);
+        __m128 wz = _mm_sub_ps(_mm_loadu_ps(v[8] + i),az);
+        __m128 nx = _mm_sub_ps(_mm_mul_ps(uy,wz),_mm_mul_ps(uz,wy));
+        __m128 ny = _mm_sub_ps(_mm_mul_ps(uz,wx),_mm_mul_ps(ux,wz));
+        __m128 nz = _mm_sub_ps(_mm_mul_ps(ux,wy),_mm_mul_ps(uy,wx));
+        __m128 d = _mm_sqrt_ps(_mm_add_ps(
+            _mm_add_ps(_mm_mul_ps(nx,nx),_mm_mul_ps(ny,ny)),
+            _mm_mul_ps(nz,nz)));
+        _mm_storeu_ps(t->n[0] + i,_mm_div_ps(nx,d));
+        _mm_storeu_ps(t->n[1] + i,_mm_div_ps(ny,d));
+        _mm_storeu_ps(t->n[2] + i,_mm_div_ps(nz,d));
+    }
+#endif
+    for (; i < t->count; i += 1) {
+        GLfloat ux = v[3][i] - v[0][i], uy = v[4][i] - v[1][i], uz = v[5][i] - v[2][i];
+        GLfloat wx = v[6][i] - v[0][i], wy = v[7][i] - v[1][i], wz = v[8][i] - v[2][i];
+        GLfloat nx = uy * wz - uz * wy;
+        GLfloat ny = uz * wx - ux * wz;
+        GLfloat nz = ux * wy - uy * wx;
+        GLfloat d = sqrtf(nx * nx + ny * ny + nz * nz);
+        t->n[0][i] = nx / d;
+        t->n[1][i] = ny / d;
+        t->n[2][i] = nz / d;
+    }
+}
+
+/* write the triangles of t as interleaved vertices, stride floats apart:
+   position, normal and, if negate is set, the negated normal.  Returns
+   the float after the last vertex. */
+static GLfloat * triEmit(const triSoA * t, GLfloat * out, int stride, int negate) {
+    int i,k,j;
+    for (i = 0; i < t->count; i += 1) {
+        for (k = 0; k < 3; k += 1) {
+            for (j = 0; j < 3; j += 1) {
+                out[j] = t->v[3 * k + j][i];
+                out[3 + j] = t->n[j][i];
+            }
+            if (negate) {
+                out[6] = - out[3];
+                out[7] = - out[4];
+                out[8] = - out[5];
+            }
+            out += stride;
+        }
+    }
+    return out;
+}
+
+/* Streaming vertex buffer.  Geometry rebuilt every frame, the cursor
+   lines and the HUD, is appended to one ring buffer through an
+   unsynchronized mapping of just the range being written, so the driver
+   never waits for draws still reading the older parts.  When the ring is
+   full it is orphaned and writing starts again at the front. */
+#define STREAM_SIZE (256 * 1024)
+static GLuint streamBuffer = 0;
+static GLsizeiptr streamSize = 0;
+static GLintptr streamHead = 0;
+
+/* copy size bytes into the ring, which is left bound to
+   GL_ARRAY_BUFFER; returns their offset in it */
+static GLintptr streamWrite(const void * data, GLsizeiptr size) {
+    GLintptr offset;
+    if (streamBuffer == 0) {
+        STATS_CALL(glGenBuffers(1,& streamBuffer));
+    }
+    STATS_CALL(glBindBuffer(GL_ARRAY_BUFFER,streamBuffer));
+    if (streamHead + size > streamSize) {
+        while (size > streamSize) {
+            streamSize = streamSize ? 2 * streamSize : STREAM_SIZE;
+        }
+        STATS_CALL(glBufferData(GL_ARRAY_BUFFER,streamSize,NULL,GL_STREAM_DRAW));
+        streamHead = 0;
+    }
+    offset = streamHead;
+    void * p = NULL;
+    if (GLAD_GL_VERSION_3_0) {
+        p = STATS_CALL(glMapBufferRange(GL_ARRAY_BUFFER,offset,size,GL_MAP_WRITE_BIT |
+            GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT));
+    }
+    if (p) {
+        memcpy(p,data,size);
+        STATS_CALL(glUnmapBuffer(GL_ARRAY_BUFFER));
     } else {
-        glNormal3f(x->d[0],x->d[1],x->d[2]);
+        STATS_CALL(glBufferSubData(GL_ARRAY_BUFFER,offset,size,data));
+    }
+    streamHead += (size + 15) & ~15;
+    return offset;
+}
+
+/* Scene batch.  The grid, platforms and marquee never change: they are
+   recorded once by bakeScene(), relative to the scene root, into the
+   static runs held in sceneBuffer.  The cursor is recorded every frame
+   after them and streamed.  Both are replayed for every mirror
+   variant.  Vertices and normals are transformed by the top of the
+   matrix stack as they are recorded; each vertex also carries its
+   negated normal for the variants that flip the world. */
+typedef struct batchVertex {
+    GLfloat p[3];
+    GLfloat n[3];
+    GLfloat nf[3];
+} batchVertex;
+
+typedef struct batchRun {
+    GLenum mode;
+    const GLfloat * material; /* lit with this material, or NULL */
+    GLfloat color[3]; /* unlit color when material is NULL */
+    int first;
+    int count;
+    GLfloat bound[4]; /* root-relative bounding sphere; radius 0 for none */
+    int culled; /* this frame */
+} batchRun;
+
+#define BATCH_RUNS 16
+static batchVertex * batchVerts = NULL;
+static int batchLength = 0;
+static int batchAlloc = 0;
+static batchRun batchRuns[BATCH_RUNS];
+static int batchRunCount = 0;
+static GLfloat batchNormal[3];
+static triSoA batchTris; /* triangles of the open run, not yet emitted */
+static int batchStaticRuns = 0; /* runs and vertices kept in sceneBuffer */
+static int batchStaticLength = 0;
+static GLuint sceneBuffer;
+static GLintptr batchStreamOffset; /* this frame's vertices in streamBuffer */
+
+/* make room for n more vertices */
+static batchVertex * batchGrow(int n) {
+    if (batchLength + n > batchAlloc) {
+        batchAlloc = batchAlloc ? batchAlloc : 1024;
+        while (batchLength + n > batchAlloc) {
+            batchAlloc *= 2;
+        }
+        batchVerts = realloc(batchVerts,sizeof(batchVertex) * batchAlloc);
+    }
+    return & batchVerts[batchLength];
+}
+
+/* compute the normals of the recorded triangles and append them */
+static void batchFlush(void) {
+    int n = 3 * batchTris.count;
+    if (n == 0) {
+        return;
     }
-    glVertex3f(x->a[0],x->a[1],x->a[2]);
-    glVertex3f(x->b[0],x->b[1],x->b[2]);
-    glVertex3f(x->c[0],x->c[1],x->c[2]);
+    triNormals(& batchTris);
+    triEmit(& batchTris,batchGrow(n)->p,sizeof(batchVertex) / sizeof(GLfloat),1);
+    batchLength += n;
+    batchRuns[batchRunCount - 1].count += n;
+    batchTris.count = 0;
+}
+
+/* drop everything recorded after the static runs */
+static void batchReset(void) {
+    batchLength = batchStaticLength;
+    batchRunCount = batchStaticRuns;
+    batchTris.count = 0;
 }
 
-/* Calculate the normal vector for a triangle with vertices
-   at a,b,c */
+/* start a run of primitives; later vertices belong to it */
+static void batchBegin(GLenum mode, const GLfloat * material) {
+    batchFlush();
+    if (batchRunCount == BATCH_RUNS) {
+        fprintf(stderr,"scene batch overflow\n");
+        exit( EXIT_FAILURE );
+    }
+    batchRun * r = & batchRuns[batchRunCount];
+    batchRunCount += 1;
+    r->mode = mode;
+    r->material = material;
+    r->color[0] = r->color[1] = r->color[2] = 1.0;
+    r->first = batchLength;
+    r->count = 0;
+    r->bound[3] = 0.0;
+    r->culled = 0;
+}
+
+/* bound the current run by a sphere at x,y,z with radius r */
+static void batchBound(double x, double y, double z, double r) {
+    batchRun * run = & batchRuns[batchRunCount - 1];
+    GLfloat c[3];
+    c[0] = x; c[1] = y; c[2] = z;
+    mat4Point(run->bound,msTop(),c);
+    run->bound[3] = r;
+}
+
+/* cull the bounded runs for this frame; root is the eye-space scene root */
+static void batchCull(const GLfloat * root) {
+    int i;
+    for (i = 0; i < batchRunCount; i += 1) {
+        batchRun * r = & batchRuns[i];
+        GLfloat c[3];
+        if (r->bound[3] > 0.0) {
+            mat4Point(c,root,r->bound);
+            r->culled = !sphereVisible(c,r->bound[3]);
+            stats.culled += r->culled;
+        }
+    }
+}
+
+static void batchColor3f(GLfloat r, GLfloat g, GLfloat b) {
+    batchRun * run = & batchRuns[batchRunCount - 1];
+    run->color[0] = r;
+    run->color[1] = g;
+    run->color[2] = b;
+}
+
+static void batchVertex3f(double x, double y, double z) {
+    const GLfloat * m = msTop();
+    batchVertex * v;
+    int i;
+    batchFlush();
+    v = batchGrow(1);
+    batchLength += 1;
+    batchRuns[batchRunCount - 1].count += 1;
+    for (i = 0; i < 3; i += 1) {
+        v->p[i] = m[i] * x + m[4 + i] * y + m[8 + i] * z + m[12 + i];
+        v->n[i] = batchNormal[i];
+        v->nf[i] = - batchNormal[i];
+    }
+}
+
+/* make everything recorded so far the static runs */
+static void batchBake(void) {
+    batchFlush();
+    glGenBuffers(1,& sceneBuffer);
+    glBindBuffer(GL_ARRAY_BUFFER,sceneBuffer);
+    glBufferData(GL_ARRAY_BUFFER,sizeof(batchVertex) * batchLength,batchVerts,GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER,0);
+    batchStaticRuns = batchRunCount;
+    batchStaticLength = batchLength;
+}
+
+/* stream the vertices recorded this frame */
+static void batchUpload(void) {
+    int n;
+    batchFlush();
+    n = batchLength - batchStaticLength;
+    if (n > 0) {
+        batchStreamOffset = streamWrite(batchVerts + batchStaticLength,sizeof(batchVertex) * n);
+        glBindBuffer(GL_ARRAY_BUFFER,0);
+    }
+}
+
+/* Record a triangle with vertices at a,b,c; its normal is computed
+   when the run is flushed */
 static void triNorm(
         double a1, double a2, double a3,
         double b1, double b2, double b3,
         double c1, double c2, double c3) {
-    double d1,d2,d3;
-    double v1,v2,v3,w1,w2,w3;
-    v1 = b1 - a1; v2 = b2 - a2; v3 = b3 - a3;
-    w1 = c1 - a1; w2 = c2 - a2; w3 = c3 - a3;
-    calcCross(&d1,&d2,&d3,v1,v2,v3,w1,w2,w3);
-    normVec(&d1,&d2,&d3);
-    if (flipWorld) {
-        glNormal3f(- d1,- d2,- d3);
-    } else {
-        glNormal3f(d1,d2,d3);
+    const GLfloat * m = msTop();
+    GLfloat p[9];
+    int i;
+    for (i = 0; i < 3; i += 1) {
+        p[i] = m[i] * a1 + m[4 + i] * a2 + m[8 + i] * a3 + m[12 + i];
+        p[3 + i] = m[i] * b1 + m[4 + i] * b2 + m[8 + i] * b3 + m[12 + i];
+        p[6 + i] = m[i] * c1 + m[4 + i] * c2 + m[8 + i] * c3 + m[12 + i];
     }
-    glVertex3f(a1,a2,a3);
-    glVertex3f(b1,b2,b3);
-    glVertex3f(c1,c2,c3);
+    triPush(& batchTris,p[0],p[1],p[2],p[3],p[4],p[5],p[6],p[7],p[8]);
 }
 
 static double BOLDTHICK = 0.1;
@@ -268,6 +820,7 @@ typedef struct Palette {
   GLfloat * colors;
   int alloc;
   int length;
+  int base; /* first entry in materialTable */
 } Palette;
 
 Palette * pa1;
@@ -282,6 +835,7 @@ Palette * mkPalette(void) {
   p->colors = malloc(sizeof(GLfloat) * 4 * alloc);
   p->alloc = alloc;
   p->length = length;
+  p->base = 0;
   return p;
 }
 
@@ -330,6 +884,40 @@ GLfloat * sbPalette(Palette * p, int i) {
   return p->colors + 4 * (i % p->length);
 }
 
+/* Material table.  Every palette is copied once into materialTable, so
+   a cone's color is just an index: the instanced shader looks it up in
+   a uniform array loaded at startup, and the fixed-function path sorts
+   its draws by it so gearMaterial() can skip repeats. */
+#define MATERIALS 64 /* size of the palette uniform array */
+static GLfloat materialTable[MATERIALS][4];
+static int materialCount = 0;
+
+static void initMaterials(void) {
+  Palette * palettes[3];
+  int i,j;
+  palettes[0] = pa1;
+  palettes[1] = pa2;
+  palettes[2] = pa3;
+  materialCount = 0;
+  for (i = 0; i < 3; i += 1) {
+      Palette * p = palettes[i];
+      if (materialCount + p->length > MATERIALS) {
+          fprintf(stderr,"palettes hold more than %d colors\n",MATERIALS);
+          exit( EXIT_FAILURE );
+      }
+      p->base = materialCount;
+      for (j = 0; j < p->length; j += 1) {
+          memcpy(materialTable[materialCount],p->colors + 4 * j,sizeof(materialTable[0]));
+          materialCount += 1;
+      }
+  }
+}
+
+/* material table index of palette entry i */
+static int idPalette(Palette * p, int i) {
+  return p->base + i % p->length;
+}
+
 /*8,6,5,4
   8
   64
@@ -354,17 +942,1341 @@ GLfloat * sbPalette(Palette * p, int i) {
 static double sunRadius = 1.0;
 static double spikeRadius = 0.125;
 
-static tnrec t1[FACES];
-static tnrec t2[FACES];
-static tnrec t3[FACES];
-static tnrec t4[FACES];
-static tnrec u1[FACES];
-static tnrec u2[FACES];
-static tnrec u3[FACES];
-static tnrec u4[FACES];
+/* Cone meshes.  Built once by initCones() into a static vertex buffer of
+   interleaved float positions and normals.  A mesh holds both halves of a
+   fold (the second half is the first turned 180 degrees about y) and is
+   stored twice, the second time with negated normals for the mirror pass.
+   Every mesh is built at CONE_LODS levels of detail, with the quarter
+   arc of the cone base cut into coneSegments[lod] segments; level
+   CONE_LOD_FACES is the FACES mesh, used for every cone without -lod. */
+#define CONE_INNER 0
+#define CONE_OUTER 1
+#define CONE_LODS 4
+#define CONE_LOD_FACES 1
+#define CONE_VERTS(lod) (2 * 4 * coneSegments[lod] * 3)
+static const int coneSegments[CONE_LODS] = {
+    2 * (FACES - 1), FACES - 1, (FACES - 1) / 2, (FACES - 1) / 4
+};
+typedef struct coneVertex {
+    GLfloat p[3];
+    GLfloat n[3];
+} coneVertex;
+static GLuint coneBuffer;
+static GLint coneFirst[CONE_LODS][2][2]; /* [lod][CONE_INNER or CONE_OUTER][flipped normals] */
+
+/* append n vertices of base, turned about y when h is -1,
+   with the normal scaled by sn */
+static coneVertex * packCone(coneVertex * v, const coneVertex * base, int n,
+        GLfloat h, GLfloat sn) {
+    int i;
+    for (i = 0; i < n; i += 1) {
+        v->p[0] = h * base[i].p[0];
+        v->p[1] = base[i].p[1];
+        v->p[2] = h * base[i].p[2];
+        v->n[0] = sn * h * base[i].n[0];
+        v->n[1] = sn * base[i].n[1];
+        v->n[2] = sn * h * base[i].n[2];
+        v += 1;
+    }
+    return v;
+}
+
+static void initCones(void) {
+  triSoA t;
+  int i,ii,lod;
+  int type,flip,half;
+  // Cone figure parameters
+  double xx[2 * FACES];
+  double yy[2 * FACES];
+  double sunRadius2[2][2] = {
+      {1.25, 0.45}, /* CONE_INNER */
+      {0.95, 0.15}  /* CONE_OUTER */
+  };
+  int total = 0;
+  for (lod = 0; lod < CONE_LODS; lod += 1) {
+    total += 4 * CONE_VERTS(lod);
+  }
+  coneVertex * vs = malloc(sizeof(coneVertex) * total);
+  coneVertex * v = vs;
+  memset(& t,0,sizeof(t));
+  for (lod = 0; lod < CONE_LODS; lod += 1) {
+    int segments = coneSegments[lod];
+    // line segments define arc of cone base
+    for (i = 0; i <= segments; i += 1) {
+      yy[i] = spikeRadius * sin(0.5 * M_PI * i / segments);
+      xx[i] = spikeRadius * cos(0.5 * M_PI * i / segments);
+    }
+    for (type = 0; type < 2; type += 1) {
+      double * r = sunRadius2[type];
+      t.count = 0;
+      for (ii = 0; ii < segments;ii += 1) {
+        triPush(& t,xx[ii],0.0,yy[ii],0.0,r[0],0.0,xx[ii + 1],0.0,yy[ii + 1]);
+        // end cap A
+        triPush(& t,0.0,-r[1],0.0,xx[ii + 0],0.0,yy[ii + 0],xx[ii + 1],0.0,yy[ii + 1]);
+        triPush(& t,-xx[ii],0.0,yy[ii],-xx[ii + 1],0.0,yy[ii + 1],0.0,r[0],0.0);
+        // end cap B
+        triPush(& t,-xx[ii],0.0,yy[ii],0.0,-r[1],0.0,-xx[ii + 1],0.0,yy[ii + 1]);
+      }
+      triNormals(& t);
+      /* the first half as computed, the rest turned or flipped copies */
+      const coneVertex * base = v;
+      int n = 3 * t.count;
+      for (flip = 0; flip < 2; flip += 1) {
+        coneFirst[lod][type][flip] = v - vs;
+        for (half = 0; half < 2; half += 1) {
+          if (flip == 0 && half == 0) {
+            v = (coneVertex *) triEmit(& t,v->p,sizeof(coneVertex) / sizeof(GLfloat),0);
+          } else {
+            v = packCone(v,base,n,half ? -1.0 : 1.0,flip ? -1.0 : 1.0);
+          }
+        }
+      }
+    }
+  }
+  for (i = 0; i < 9; i += 1) {
+    free(t.v[i]);
+  }
+  for (i = 0; i < 3; i += 1) {
+    free(t.n[i]);
+  }
+  glGenBuffers(1,& coneBuffer);
+  glBindBuffer(GL_ARRAY_BUFFER,coneBuffer);
+  glBufferData(GL_ARRAY_BUFFER,sizeof(coneVertex) * (v - vs),vs,GL_STATIC_DRAW);
+  glBindBuffer(GL_ARRAY_BUFFER,0);
+  free(vs);
+}
+
+/* Mirror variants.  Bit v of mirrorMask enables variant v: the scene
+   as is, mirrored left-right, mirrored top-bottom, and turned 180
+   degrees.  The scene is traversed once per frame and every Sol instance
+   and batch run is emitted once per enabled variant, so extra variants
+   cost only their share of the GPU work. */
+#define VARIANTS 4
+static int mirrorMask = 0x3;
+static const GLfloat mirrorSign[VARIANTS][2] = {
+    { 1.0, 1.0}, /* as is */
+    {-1.0, 1.0}, /* left-right */
+    { 1.0,-1.0}, /* top-bottom */
+    {-1.0,-1.0}  /* 180 degree rotation */
+};
+
+/* a mirror reverses the world's handedness, so normals are negated */
+static int variantFlip(int v) {
+    return mirrorSign[v][0] * mirrorSign[v][1] < 0.0;
+}
+
+/* dst = M * src, where M is the eye-space mirror of variant v */
+static void mirrorMatrix(GLfloat * dst, const GLfloat * src, int v) {
+    int j;
+    for (j = 0; j < 4; j += 1) {
+        dst[4 * j + 0] = mirrorSign[v][0] * src[4 * j + 0];
+        dst[4 * j + 1] = mirrorSign[v][1] * src[4 * j + 1];
+        dst[4 * j + 2] = src[4 * j + 2];
+        dst[4 * j + 3] = src[4 * j + 3];
+    }
+}
+
+/* LIGHT0 for variant v: lightpos reflected to the other side of the
+   scene, placed under that variant's mirror */
+static void variantLight(int v) {
+    GLfloat view[16];
+    GLfloat pos[4];
+    mat4Identity(view);
+    mirrorMatrix(view,view,v);
+    pos[0] = mirrorSign[v][0] * frame->lightpos[0];
+    pos[1] = mirrorSign[v][1] * frame->lightpos[1];
+    pos[2] = frame->lightpos[2];
+    pos[3] = frame->lightpos[3];
+    STATS_CALL(glLoadMatrixf(view));
+    STATS_CALL(glLightfv(GL_LIGHT0,GL_POSITION,pos));
+}
+
+/* Sol instances.  The lattice positions that pass the outerp/innerp
+   predicate never change, so they are compacted into solList once by
+   initSols().  Every frame gatherSols() walks that list in one loop,
+   writing an eye-space model matrix and a material index for each fold
+   and enabled mirror variant into instances[], and drawSols() submits
+   each cone type with a single instanced draw. */
+#define SOL_MAX 250 /* Sols that pass the predicate, with room to spare */
+typedef struct solRec {
+    GLfloat lattice[3];
+    int fr;
+    int ci;
+    int innerp;
+    double rsgn;
+    double axis[3];
+    Palette * palette;
+} solRec;
+
+typedef struct solInstance {
+    GLfloat m[16];
+    GLfloat material; /* materialTable index */
+    GLfloat variant;
+} solInstance;
+
+static solRec solList[SOL_MAX];
+static int solCount = 0;
+/* [CONE_INNER or CONE_OUTER], then maxFolds[type] entries per variant */
+static solInstance * instances[2];
+static int maxFolds[2];
+static int instanceCount[2]; /* per variant */
+static int lodStart[2][CONE_LODS + 1]; /* each level's first instance in a variant's run */
+static int * instanceOrder[2]; /* per variant run, sorted by material */
+static GLuint instanceBuffer;
+static GLuint instanceProgram;
+static GLint instanceAlphaLoc;
+static GLint instanceLightLoc;
+static GLint instanceHalfLoc;
+static GLint instanceSignLoc;
+static GLint instancePaletteLoc;
+static int useInstancing = 1;
+
+#define ATTRIB_POSITION 0
+#define ATTRIB_NORMAL 1
+#define ATTRIB_MATERIAL 2
+#define ATTRIB_VARIANT 3
+#define ATTRIB_MODEL 4 /* takes four slots */
+#define ATTRIB_COLOR 8 /* line color, core renderer */
+
+/* per-vertex copy of the fixed-function LIGHT0 model used by draw2(),
+   with the light and normal sign chosen by the instance's variant */
+static const char * instanceVertexText =
+"#version 120\n"
+"attribute vec3 position;\n"
+"attribute vec3 normal;\n"
+"attribute float instMaterial;\n"
+"attribute float instVariant;\n"
+"attribute mat4 instModel;\n"
+"uniform float matAlpha;\n"
+"uniform vec3 lightDir[4];\n"
+"uniform vec3 halfDir[4];\n"
+"uniform float normalSign[4];\n"
+"uniform vec3 palette[64];\n"
+"void main()\n"
+"{\n"
+"    int v = int(instVariant);\n"
+"    vec3 instColor = palette[int(instMaterial)];\n"
+"    mat3 m3 = mat3(instModel[0].xyz, instModel[1].xyz, instModel[2].xyz);\n"
+"    vec3 n = normalSign[v] * normalize(m3 * normal);\n"
+"    float nl = max(dot(n, lightDir[v]), 0.0);\n"
+"    float nh = max(dot(n, halfDir[v]), 0.0);\n"
+"    vec3 c = gl_LightModel.ambient.rgb * gl_FrontMaterial.ambient.rgb;\n"
+"    c += nl * gl_LightSource[0].diffuse.rgb * (0.4 * instColor);\n"
+"    if (nl > 0.0) {\n"
+"        c += pow(nh, 50.0) * gl_LightSource[0].specular.rgb * instColor;\n"
+"    }\n"
+"    gl_FrontColor = vec4(c, matAlpha);\n"
+"    gl_Position = gl_ProjectionMatrix * (instModel * vec4(position, 1.0));\n"
+"}\n";
+
+static const char * instanceFragmentText =
+"#version 120\n"
+"void main()\n"
+"{\n"
+"    gl_FragColor = gl_Color;\n"
+"}\n";
+
+static GLuint makeShader(GLenum type, const char * text) {
+    GLuint shader = glCreateShader(type);
+    GLint ok;
+    char log[4096];
+    glShaderSource(shader,1,& text,NULL);
+    glCompileShader(shader);
+    glGetShaderiv(shader,GL_COMPILE_STATUS,& ok);
+    if (ok != GL_TRUE) {
+        glGetShaderInfoLog(shader,sizeof(log),NULL,log);
+        fprintf(stderr,"shader compile failed:\n%s\n",log);
+        glDeleteShader(shader);
+        return 0;
+    }
+    return shader;
+}
+
+static GLuint makeProgram(const char * vertexText, const char * fragmentText) {
+    GLuint vs = makeShader(GL_VERTEX_SHADER,vertexText);
+    GLuint fs = makeShader(GL_FRAGMENT_SHADER,fragmentText);
+    GLuint program;
+    GLint ok;
+    if (vs == 0 || fs == 0) {
+        return 0;
+    }
+    program = glCreateProgram();
+    glAttachShader(program,vs);
+    glAttachShader(program,fs);
+    glBindAttribLocation(program,ATTRIB_POSITION,"position");
+    glBindAttribLocation(program,ATTRIB_NORMAL,"normal");
+    glBindAttribLocation(program,ATTRIB_MATERIAL,"instMaterial");
+    glBindAttribLocation(program,ATTRIB_VARIANT,"instVariant");
+    glBindAttribLocation(program,ATTRIB_MODEL,"instModel");
+    glBindAttribLocation(program,ATTRIB_COLOR,"color");
+    glLinkProgram(program);
+    glDeleteShader(vs);
+    glDeleteShader(fs);
+    glGetProgramiv(program,GL_LINK_STATUS,& ok);
+    if (ok != GL_TRUE) {
+        fprintf(stderr,"shader link failed\n");
+        glDeleteProgram(program);
+        return 0;
+    }
+    return program;
+}
+
+/* compact the Sol lattice and set up the instanced renderer */
+static void initSols(void) {
+  int p1,p2,p3,fr;
+  int ci = 0;
+  int div = 5;
+  double disp = 2.75;
+  double disp2 = 2 * disp;
+  initMaterials();
+  maxFolds[CONE_INNER] = maxFolds[CONE_OUTER] = 0;
+  for (p1 = 0; p1 < div; p1 += 1) {
+    for (p2 = 0; p2 < div; p2 += 1) {
+      for (p3 = 0; p3 < div; p3 += 1) {
+        ci += 1;
+        for (fr = 0; fr < 2; fr += 1) {
+          int outerp = p1 % 2 == 0 && p2 % 2 == 0 && p3 % 2 == 0;
+          int outerp2 = ( (p1 + p2 + p3) / 2) % 2 == 0;
+          int innerp = p1 >= 1 && p1 <= 3 && p2 >= 1 && p2 <= 3 && p3 >= 1 && p3 <= 3;
+          int innerp2 = (p1 + p2 + p3) % 5 == 4;
+          if ( !( (outerp && outerp2) || (innerp && innerp2) ) ) {
+              continue;
+          }
+          if (solCount == SOL_MAX) {
+              fprintf(stderr,"more than %d Sols\n",SOL_MAX);
+              exit( EXIT_FAILURE );
+          }
+          solRec * sol = & solList[solCount];
+          solCount += 1;
+          sol->lattice[0] = -disp2 + disp * p1;
+          sol->lattice[1] = -disp2 + disp * p2;
+          sol->lattice[2] = -disp2 + disp * p3;
+          sol->fr = fr;
+          sol->ci = ci;
+          sol->innerp = innerp;
+          sol->rsgn = ci % 2 == 0 ? -1 : 1;
+          sol->axis[0] = sol->axis[1] = sol->axis[2] = 0.0;
+          sol->axis[ci % 6 < 2 ? 0 : ci % 6 < 4 ? 1 : 2] = 1.0;
+          if (outerp) {
+              sol->palette = pa2;
+          } else if (ci % 2 == 0) {
+              sol->palette = pa1;
+          } else {
+              sol->palette = pa3;
+          }
+          if (innerp) {
+              maxFolds[CONE_INNER] += 2 * (CONE_MIN + CONE_DELTA);
+          } else {
+              maxFolds[CONE_OUTER] += 3 * (CONE_MIN + CONE_DELTA);
+          }
+        }
+      }
+    }
+  }
+  instances[CONE_INNER] = malloc(sizeof(solInstance) * VARIANTS *
+      (maxFolds[CONE_INNER] + maxFolds[CONE_OUTER]));
+  instances[CONE_OUTER] = instances[CONE_INNER] + VARIANTS * maxFolds[CONE_INNER];
+  instanceOrder[CONE_INNER] = malloc(sizeof(int) * (maxFolds[CONE_INNER] + maxFolds[CONE_OUTER]));
+  instanceOrder[CONE_OUTER] = instanceOrder[CONE_INNER] + maxFolds[CONE_INNER];
+  glGenBuffers(1,& instanceBuffer);
+  if (useCore) {
+      useInstancing = 0; /* the core renderer has its own cone program */
+  }
+  if (useInstancing && !GLAD_GL_VERSION_3_3) {
+      printf("OpenGL 3.3 not available; drawing Sols one fold at a time\n");
+      useInstancing = 0;
+  }
+  if (useInstancing) {
+      instanceProgram = makeProgram(instanceVertexText,instanceFragmentText);
+      useInstancing = instanceProgram != 0;
+  }
+  if (useInstancing) {
+      instanceAlphaLoc = glGetUniformLocation(instanceProgram,"matAlpha");
+      instanceLightLoc = glGetUniformLocation(instanceProgram,"lightDir");
+      instanceHalfLoc = glGetUniformLocation(instanceProgram,"halfDir");
+      instanceSignLoc = glGetUniformLocation(instanceProgram,"normalSign");
+      instancePaletteLoc = glGetUniformLocation(instanceProgram,"palette");
+      GLfloat palette[MATERIALS][3];
+      int i;
+      for (i = 0; i < materialCount; i += 1) {
+          memcpy(palette[i],materialTable[i],sizeof(palette[i]));
+      }
+      glUseProgram(instanceProgram);
+      glUniform3fv(instancePaletteLoc,materialCount,& palette[0][0]);
+      glUseProgram(0);
+  }
+}
+
+/* Cone level of detail.  Each Sol takes the coarsest mesh whose largest
+   distance from the true cone base, projected at the Sol's depth, stays
+   under lodThreshold pixels.  The cones are flat shaded with a normal per
+   facet, so a mesh coarser than FACES changes the shading of the whole
+   cone, not just its outline: those are only taken once the cone is
+   under LOD_COARSE_PIXELS across.  Off unless -lod is given; [ and ]
+   halve and double the threshold. */
+#define LOD_COARSE_PIXELS 4.0
+static double lodThreshold = 0.5; /* pixels, -lod */
+static int useLod = 0;
+static double lodPixels = 300.0; /* pixels per eye-space unit at unit depth, set by reshape() */
+static GLfloat solMatrix[SOL_MAX][16]; /* per Sol, for gatherSols() */
+static int solLod[SOL_MAX];
+
+/* the level of detail for a Sol whose eye-space matrix is m */
+static int coneLod(const GLfloat * m) {
+  int lod;
+  if (!useLod) {
+      return CONE_LOD_FACES;
+  }
+  /* the fold doubles the cone, and the Sol's scale is uniform */
+  double radius = 2.0 * spikeRadius * sqrt(m[0] * m[0] + m[1] * m[1] + m[2] * m[2]);
+  double depth = -m[14] < 5.0 ? 5.0 : -m[14]; /* not nearer than znear */
+  double pixels = lodPixels * radius / depth;
+  lod = 2.0 * pixels < LOD_COARSE_PIXELS ? CONE_LODS - 1 : CONE_LOD_FACES;
+  for (; lod > 0; lod -= 1) {
+      if (pixels * (1.0 - cos(0.25 * M_PI / coneSegments[lod])) <= lodThreshold) {
+          break;
+      }
+  }
+  return lod;
+}
+
+/* Sol workers.  Once gatherSols() has placed every visible Sol's folds
+   in instances[], the CONES x copy chain of fold matrices of each Sol
+   depends only on the frame, so the Sols are handed out SOL_CHUNK at a
+   time to solThreads workers and the render thread, each writing its
+   Sols' disjoint slots. */
+#define SOL_CHUNK 4
+#define SOL_MAX_THREADS 31
+static int solThreads = -1; /* workers besides the render thread; -1: one per extra core */
+static thrd_t solWorkers[SOL_MAX_THREADS];
+static mtx_t solLock;
+static cnd_t solStart; /* a new frame's Sols are ready to take */
+static cnd_t solDone; /* the last worker finished */
+static long solGeneration = 0;
+static int solNext; /* next Sol to hand out */
+static int solBusy; /* workers still on this frame */
+static int solOut[SOL_MAX]; /* first slot of each Sol in its type's run */
+static GLfloat solFold[16]; /* first fold, relative to the cone frame */
+static GLfloat solStep[16]; /* from one fold to the next */
+static GLfloat solTheta1[16];
+
+/* write the fold instances of Sol s */
+static void gatherSol(int s) {
+  int j,k,v;
+  int CONES = frame->cones;
+  solRec * sol = & solList[s];
+  int type = sol->innerp ? CONE_INNER : CONE_OUTER;
+  int copy = sol->innerp ? 2 : 3;
+  solInstance * out = instances[type] + solOut[s];
+  GLfloat m[16];
+  memcpy(m,solMatrix[s],sizeof(m));
+  for (k = 0;k < CONES;k += 1) {
+    if ( k == CONES / 2 ) {
+        mat4Rotate(m,frame->VENUS2 * 180.0,1.0,0.0,0.0);
+    }
+    GLfloat material = idPalette(sol->palette,k);
+    for (j = 0;j < copy;j += 1) {
+      memcpy(out->m,m,sizeof(m));
+      mat4Mul(out->m,solFold);
+      out->material = material;
+      out->variant = 0.0;
+      for (v = 1; v < VARIANTS; v += 1) {
+        if (mirrorMask & (1 << v)) {
+          solInstance * mv = out + v * maxFolds[type];
+          mirrorMatrix(mv->m,out->m,v);
+          mv->material = material;
+          mv->variant = v;
+        }
+      }
+      out += 1;
+      mat4Mul(m,solStep);
+    }
+    mat4Mul(m,solTheta1);
+  }
+}
+
+/* take chunks of Sols until none are left; call with solLock held */
+static void solDrain(void) {
+  while (solNext < solCount) {
+      int first = solNext;
+      int last = first + SOL_CHUNK < solCount ? first + SOL_CHUNK : solCount;
+      int s;
+      solNext = last;
+      mtx_unlock(& solLock);
+      for (s = first; s < last; s += 1) {
+          if (solLod[s] >= 0) {
+              gatherSol(s);
+          }
+      }
+      mtx_lock(& solLock);
+  }
+}
+
+static int solWorker(void * arg) {
+  long seen = 0;
+  mtx_lock(& solLock);
+  for (;;) {
+      while (solGeneration == seen) {
+          cnd_wait(& solStart,& solLock);
+      }
+      seen = solGeneration;
+      solDrain();
+      solBusy -= 1;
+      if (solBusy == 0) {
+          cnd_signal(& solDone);
+      }
+  }
+  return 0;
+}
+
+static void solPoolBegin(void) {
+  int i;
+  if (solThreads < 0) {
+      solThreads = (int) sysconf(_SC_NPROCESSORS_ONLN) - 1;
+  }
+  solThreads = solThreads < 0 ? 0 : solThreads;
+  solThreads = solThreads > SOL_MAX_THREADS ? SOL_MAX_THREADS : solThreads;
+  mtx_init(& solLock,mtx_plain);
+  cnd_init(& solStart);
+  cnd_init(& solDone);
+  for (i = 0; i < solThreads; i += 1) {
+      if (thrd_create(& solWorkers[i],solWorker,NULL) != thrd_success) {
+          solThreads = i;
+          break;
+      }
+  }
+}
+
+/* write every visible Sol's folds, on the pool and the render thread */
+static void solPoolRun(void) {
+  if (solThreads == 0) {
+      int s;
+      for (s = 0; s < solCount; s += 1) {
+          if (solLod[s] >= 0) {
+              gatherSol(s);
+          }
+      }
+      return;
+  }
+  mtx_lock(& solLock);
+  solNext = 0;
+  solBusy = solThreads;
+  solGeneration += 1;
+  cnd_broadcast(& solStart);
+  solDrain();
+  while (solBusy > 0) {
+      cnd_wait(& solDone,& solLock);
+  }
+  mtx_unlock(& solLock);
+}
+
+/* fill instances[] for this frame from the Sol list, each type's run
+   grouped by level of detail; solFrame is the eye-space frame the
+   lattice hangs from.  Culling, the Sol matrices and the layout are
+   done here, the folds by the Sol workers. */
+static void gatherSols(const GLfloat * solFrame,
+        const GLfloat * theta1, const GLfloat * theta2) {
+  int s,j,k;
+  int CONES = frame->cones;
+  double solscale = frame->solscale;
+  mat4Identity(solFold);
+  mat4Translate(solFold,0.0,sunRadius,0.0);
+  mat4Scale(solFold,2.0,2.0,2.0);
+  mat4Mul(solFold,theta1);
+  memcpy(solStep,theta2,sizeof(solStep));
+  mat4Translate(solStep,0.1,0.0,0.0);
+  memcpy(solTheta1,theta1,sizeof(solTheta1));
+  int next[2][CONE_LODS];
+  memset(next,0,sizeof(next));
+  /* a cone reaches sunRadius plus twice its inner length from its fold,
+     and each step moves the next fold 0.1 */
+  double reach = sunRadius + 2.0 * 1.25 + 0.1 * CONES * 3;
+  for (s = 0; s < solCount; s += 1) {
+    solRec * sol = & solList[s];
+    float sx = 0.5 / ((float) 1.0 + 2.0 * sol->fr);
+    /* bounding sphere about the lattice point, before any transforms */
+    GLfloat flip = sol->fr == 1 ? -1.0 : 1.0;
+    GLfloat center[3], c[3];
+    center[0] = solscale * flip * sx * sol->lattice[0];
+    center[1] = solscale * (5.0 * sol->fr + flip * sx * sol->lattice[1]);
+    center[2] = solscale * sx * sol->lattice[2];
+    double radius = sol->innerp ? fabs(frame->waveInner) + 0.9 * reach :
+        fabs(frame->waveOuter) + 0.6 * reach;
+    mat4Point(c,solFrame,center);
+    if (!sphereVisible(c,solscale * sx * radius)) {
+        solLod[s] = -1;
+        stats.culled += 1;
+        continue;
+    }
+    GLfloat * m = solMatrix[s];
+    memcpy(m,solFrame,sizeof(solMatrix[s]));
+    mat4Scale(m,solscale,solscale,solscale);
+    mat4Translate(m,0.0,5.0 * sol->fr,0.0);
+    mat4Scale(m,sx,sx,sx);
+    if (sol->fr == 1) {
+        mat4Scale(m,-1.0,-1.0,1.0);
+    }
+    mat4Translate(m,sol->lattice[0],sol->lattice[1],sol->lattice[2]);
+    mat4Rotate(m,fmod(sol->rsgn * frame->sunAngle2,360.0),sol->axis[0],sol->axis[1],sol->axis[2]);
+    if ( sol->innerp ) {
+        mat4Translate(m,frame->waveInner,0.0,0.0);
+        mat4Scale(m,0.9,0.9,0.9);
+    } else {
+        mat4Translate(m,0.0,frame->waveOuter,0.0);
+        mat4Scale(m,0.6,0.6,0.6);
+    }
+    solLod[s] = coneLod(m);
+    next[sol->innerp ? CONE_INNER : CONE_OUTER][solLod[s]] += CONES * (sol->innerp ? 2 : 3);
+  }
+  for (k = 0; k < 2; k += 1) {
+    lodStart[k][0] = 0;
+    for (j = 0; j < CONE_LODS; j += 1) {
+      lodStart[k][j + 1] = lodStart[k][j] + next[k][j];
+      next[k][j] = lodStart[k][j];
+    }
+    instanceCount[k] = lodStart[k][CONE_LODS];
+  }
+  for (s = 0; s < solCount; s += 1) {
+    solRec * sol = & solList[s];
+    int type = sol->innerp ? CONE_INNER : CONE_OUTER;
+    if (solLod[s] >= 0) {
+        solOut[s] = next[type][solLod[s]];
+        next[type][solLod[s]] += CONES * (sol->innerp ? 2 : 3);
+    }
+  }
+  solPoolRun();
+}
+
+/* counting sort of each level of the first variant's run of each type
+   by material; the other variants hold the same materials in the same
+   order */
+static void sortSols(void) {
+  int type,lod,i;
+  int start[MATERIALS + 1];
+  for (type = 0; type < 2; type += 1) {
+    for (lod = 0; lod < CONE_LODS; lod += 1) {
+      const solInstance * run = instances[type];
+      int first = lodStart[type][lod];
+      int last = lodStart[type][lod + 1];
+      memset(start,0,sizeof(start));
+      start[0] = first;
+      for (i = first; i < last; i += 1) {
+          start[(int) run[i].material + 1] += 1;
+      }
+      for (i = 0; i < MATERIALS; i += 1) {
+          start[i + 1] += start[i];
+      }
+      for (i = first; i < last; i += 1) {
+          instanceOrder[type][start[(int) run[i].material]++] = i;
+      }
+    }
+  }
+}
+
+/* unit eye-space light and half-angle vectors of LIGHT0 as
+   variantLight() places it for variant v */
+static void variantDirs(int v, GLfloat * lightDir, GLfloat * halfDir) {
+  /* for a pure reflection the two flips cancel */
+  GLfloat l[3];
+  int i;
+  l[0] = mirrorSign[v][0] * mirrorSign[v][0] * frame->lightpos[0];
+  l[1] = mirrorSign[v][1] * mirrorSign[v][1] * frame->lightpos[1];
+  l[2] = frame->lightpos[2];
+  GLfloat d = sqrt(l[0] * l[0] + l[1] * l[1] + l[2] * l[2]);
+  GLfloat h = 0.0;
+  for (i = 0; i < 3; i += 1) {
+      lightDir[i] = l[i] / d;
+      halfDir[i] = lightDir[i] + (i == 2 ? 1.0 : 0.0);
+      h += halfDir[i] * halfDir[i];
+  }
+  for (i = 0; i < 3; i += 1) {
+      halfDir[i] /= sqrt(h);
+  }
+}
+
+/* copy the enabled variants of instances[] into instanceBuffer, the
+   variants of each type and level back to back; returns the number of
+   variants */
+static int uploadSols(void) {
+  int type,lod,v;
+  int active = 0;
+  for (v = 0; v < VARIANTS; v += 1) {
+      active += (mirrorMask >> v) & 1;
+  }
+  int total = active * (instanceCount[CONE_INNER] + instanceCount[CONE_OUTER]);
+  size_t offset = 0;
+  STATS_CALL(glBindBuffer(GL_ARRAY_BUFFER,instanceBuffer));
+  STATS_CALL(glBufferData(GL_ARRAY_BUFFER,sizeof(solInstance) * total,NULL,GL_STREAM_DRAW));
+  for (type = 0; type < 2; type += 1) {
+    for (lod = 0; lod < CONE_LODS; lod += 1) {
+      int first = lodStart[type][lod];
+      size_t size = sizeof(solInstance) * (lodStart[type][lod + 1] - first);
+      for (v = 0; v < VARIANTS; v += 1) {
+          if (size > 0 && (mirrorMask & (1 << v))) {
+              STATS_CALL(glBufferSubData(GL_ARRAY_BUFFER,offset,size,
+                  instances[type] + v * maxFolds[type] + first));
+              offset += size;
+          }
+      }
+    }
+  }
+  return active;
+}
+
+/* one instanced draw per cone type and level from instanceBuffer with
+   the current program */
+static void drawSolInstances(int active) {
+  int type,lod,i;
+  STATS_CALL(glBindBuffer(GL_ARRAY_BUFFER,coneBuffer));
+  STATS_CALL(glEnableVertexAttribArray(ATTRIB_POSITION));
+  STATS_CALL(glEnableVertexAttribArray(ATTRIB_NORMAL));
+  STATS_CALL(glVertexAttribPointer(ATTRIB_POSITION,3,GL_FLOAT,GL_FALSE,sizeof(coneVertex),
+      (void *) offsetof(coneVertex,p)));
+  STATS_CALL(glVertexAttribPointer(ATTRIB_NORMAL,3,GL_FLOAT,GL_FALSE,sizeof(coneVertex),
+      (void *) offsetof(coneVertex,n)));
+  STATS_CALL(glBindBuffer(GL_ARRAY_BUFFER,instanceBuffer));
+  for (i = ATTRIB_MATERIAL; i < ATTRIB_MODEL + 4; i += 1) {
+      STATS_CALL(glEnableVertexAttribArray(i));
+      STATS_CALL(glVertexAttribDivisor(i,1));
+  }
+  size_t base = 0;
+  for (type = 0; type < 2; type += 1) {
+    for (lod = 0; lod < CONE_LODS; lod += 1) {
+      int count = lodStart[type][lod + 1] - lodStart[type][lod];
+      if (count == 0) {
+          continue;
+      }
+      STATS_CALL(glVertexAttribPointer(ATTRIB_MATERIAL,1,GL_FLOAT,GL_FALSE,sizeof(solInstance),
+          (void *) (base + offsetof(solInstance,material))));
+      STATS_CALL(glVertexAttribPointer(ATTRIB_VARIANT,1,GL_FLOAT,GL_FALSE,sizeof(solInstance),
+          (void *) (base + offsetof(solInstance,variant))));
+      for (i = 0; i < 4; i += 1) {
+          STATS_CALL(glVertexAttribPointer(ATTRIB_MODEL + i,4,GL_FLOAT,GL_FALSE,
+              sizeof(solInstance),
+              (void *) (base + offsetof(solInstance,m) + 4 * i * sizeof(GLfloat))));
+      }
+      STATS_DRAW((long) CONE_VERTS(lod) * active * count,
+          glDrawArraysInstanced(GL_TRIANGLES,coneFirst[lod][type][0],CONE_VERTS(lod),
+          active * count));
+      stats.triangles += (long) CONE_VERTS(lod) / 3 * active * count;
+      base += sizeof(solInstance) * active * count;
+    }
+  }
+  for (i = ATTRIB_MATERIAL; i < ATTRIB_MODEL + 4; i += 1) {
+      STATS_CALL(glVertexAttribDivisor(i,0));
+      STATS_CALL(glDisableVertexAttribArray(i));
+  }
+  STATS_CALL(glDisableVertexAttribArray(ATTRIB_NORMAL));
+  STATS_CALL(glDisableVertexAttribArray(ATTRIB_POSITION));
+  STATS_CALL(glBindBuffer(GL_ARRAY_BUFFER,0));
+}
+
+/* submit instances[] for every enabled variant */
+static void drawSols(void) {
+  int type,lod,i,v;
+  if (!useInstancing) {
+      sortSols();
+      STATS_CALL(glBindBuffer(GL_ARRAY_BUFFER,coneBuffer));
+      STATS_CALL(glEnableClientState(GL_VERTEX_ARRAY));
+      STATS_CALL(glEnableClientState(GL_NORMAL_ARRAY));
+      STATS_CALL(glVertexPointer(3,GL_FLOAT,sizeof(coneVertex),
+          (void *) offsetof(coneVertex,p)));
+      STATS_CALL(glNormalPointer(GL_FLOAT,sizeof(coneVertex),(void *) offsetof(coneVertex,n)));
+      for (v = 0; v < VARIANTS; v += 1) {
+        if (!(mirrorMask & (1 << v))) {
+            continue;
+        }
+        variantLight(v);
+        for (type = 0; type < 2; type += 1) {
+          solInstance * run = instances[type] + v * maxFolds[type];
+          for (lod = 0; lod < CONE_LODS; lod += 1) {
+            int first = lodStart[type][lod];
+            int count = lodStart[type][lod + 1] - first;
+            for (i = first; i < first + count; i += 1) {
+              const solInstance * in = & run[instanceOrder[type][i]];
+              gearMaterial(GL_FRONT,materialTable[(int) in->material]);
+              STATS_CALL(glLoadMatrixf(in->m));
+              STATS_DRAW(CONE_VERTS(lod),
+                  glDrawArrays(GL_TRIANGLES,coneFirst[lod][type][variantFlip(v)],
+                  CONE_VERTS(lod)));
+            }
+            stats.triangles += (long) CONE_VERTS(lod) / 3 * count;
+          }
+        }
+      }
+      STATS_CALL(glDisableClientState(GL_NORMAL_ARRAY));
+      STATS_CALL(glDisableClientState(GL_VERTEX_ARRAY));
+      STATS_CALL(glBindBuffer(GL_ARRAY_BUFFER,0));
+      return;
+  }
+  GLfloat lightDir[VARIANTS][3];
+  GLfloat halfDir[VARIANTS][3];
+  GLfloat normalSign[VARIANTS];
+  for (v = 0; v < VARIANTS; v += 1) {
+      variantDirs(v,lightDir[v],halfDir[v]);
+      normalSign[v] = variantFlip(v) ? -1.0 : 1.0;
+  }
+  int active = uploadSols();
+  STATS_CALL(glLoadIdentity());
+  STATS_CALL(glUseProgram(instanceProgram));
+  STATS_CALL(glUniform1f(instanceAlphaLoc,frame->matAlpha));
+  STATS_CALL(glUniform3fv(instanceLightLoc,VARIANTS,& lightDir[0][0]));
+  STATS_CALL(glUniform3fv(instanceHalfLoc,VARIANTS,& halfDir[0][0]));
+  STATS_CALL(glUniform1fv(instanceSignLoc,VARIANTS,normalSign));
+  drawSolInstances(active);
+  STATS_CALL(glUseProgram(0));
+}
+
+/* point the vertex arrays at the static runs, or at this frame's
+   streamed runs if dynamic, with normals negated for flip; returns the
+   index to take from the runs' first vertex */
+static int batchSource(int dynamic, int flip) {
+  GLintptr offset = 0;
+  if (dynamic) {
+      STATS_CALL(glBindBuffer(GL_ARRAY_BUFFER,streamBuffer));
+      offset = batchStreamOffset;
+  } else {
+      STATS_CALL(glBindBuffer(GL_ARRAY_BUFFER,sceneBuffer));
+  }
+  if (useCore) {
+      STATS_CALL(glVertexAttribPointer(ATTRIB_POSITION,3,GL_FLOAT,GL_FALSE,sizeof(batchVertex),
+          (void *) (offset + offsetof(batchVertex,p))));
+      STATS_CALL(glVertexAttribPointer(ATTRIB_NORMAL,3,GL_FLOAT,GL_FALSE,sizeof(batchVertex),
+          (void *) (offset + offsetof(batchVertex,n))));
+  } else {
+      STATS_CALL(glVertexPointer(3,GL_FLOAT,sizeof(batchVertex),
+          (void *) (offset + offsetof(batchVertex,p))));
+      STATS_CALL(glNormalPointer(GL_FLOAT,sizeof(batchVertex),
+          (void *) (offset + (flip ? offsetof(batchVertex,nf) : offsetof(batchVertex,n)))));
+  }
+  return dynamic ? batchStaticLength : 0;
+}
+
+/* replay the scene batch for variant v; root is the eye-space scene root */
+static void drawBatch(const GLfloat * root, int v) {
+  GLfloat m[16];
+  int i,base = 0;
+  mirrorMatrix(m,root,v);
+  STATS_CALL(glLoadMatrixf(m));
+  STATS_CALL(glEnableClientState(GL_VERTEX_ARRAY));
+  STATS_CALL(glEnableClientState(GL_NORMAL_ARRAY));
+  for (i = 0; i < batchRunCount; i += 1) {
+      batchRun * r = & batchRuns[i];
+      if (i == 0 || i == batchStaticRuns) {
+          base = batchSource(i >= batchStaticRuns,variantFlip(v));
+      }
+      if (r->count == 0 || r->culled) {
+          continue;
+      }
+      if (r->material) {
+          STATS_CALL(glEnable(GL_LIGHTING));
+          STATS_CALL(glEnable(GL_LIGHT0));
+          gearMaterial(GL_FRONT,r->material);
+      } else {
+          STATS_CALL(glDisable(GL_LIGHTING));
+          STATS_CALL(glColor3fv(r->color));
+      }
+      STATS_DRAW(r->count,glDrawArrays(r->mode,r->first - base,r->count));
+      stats.triangles += r->mode == GL_TRIANGLES ? r->count / 3 : 0;
+  }
+  STATS_CALL(glDisableClientState(GL_NORMAL_ARRAY));
+  STATS_CALL(glDisableClientState(GL_VERTEX_ARRAY));
+  STATS_CALL(glBindBuffer(GL_ARRAY_BUFFER,0));
+}
+
+/* Core-profile renderer.  With -core gears asks for a 3.3 core context,
+   as heightmap does, and every fixed-function path is replaced by one of
+   three programs: coreLineProgram for unlit lines (grid, HUD),
+   coreLitProgram for the lit scene batch (platforms, cursor, marquee)
+   and coreConeProgram for the instanced cones.  LIGHT0's per-variant
+   directions, the normal signs and matAlpha live in the Lights uniform
+   block, rewritten once per frame; the material table lives in the
+   Palette block, filled once.  Both lit programs evaluate the LIGHT0
+   model of the fixed-function path per fragment. */
+#define CORE_LIGHTS_BINDING 0
+#define CORE_PALETTE_BINDING 1
+
+typedef struct coreLights { /* std140 layout of the Lights block */
+    GLfloat lightDir[VARIANTS][4];
+    GLfloat halfDir[VARIANTS][4];
+    GLfloat normalSign[4]; /* per variant */
+    GLfloat light[4]; /* LIGHT0 diffuse and specular, matAlpha */
+    GLfloat ambient[4]; /* light model ambient times material ambient */
+} coreLights;
+
+typedef struct hudVertex {
+    GLfloat p[3];
+    GLfloat c[3];
+} hudVertex;
+
+static GLfloat projection[16]; /* set by reshape() */
+static GLuint coreVao;
+static GLuint coreLineProgram;
+static GLuint coreLitProgram;
+static GLuint coreConeProgram;
+static GLuint coreLightsBuffer;
+static GLuint corePaletteBuffer;
+static GLint coreLineProjectionLoc;
+static GLint coreLineModelLoc;
+static GLint coreLitProjectionLoc;
+static GLint coreLitModelLoc;
+static GLint coreLitVariantLoc;
+static GLint coreLitColorLoc;
+static GLint coreConeProjectionLoc;
+
+static const char * coreLineVertexText =
+"#version 330 core\n"
+"uniform mat4 projection;\n"
+"uniform mat4 model;\n"
+"in vec3 position;\n"
+"in vec3 color;\n"
+"out vec3 vColor;\n"
+"void main()\n"
+"{\n"
+"    vColor = color;\n"
+"    gl_Position = projection * (model * vec4(position, 1.0));\n"
+"}\n";
+
+static const char * coreLineFragmentText =
+"#version 330 core\n"
+"in vec3 vColor;\n"
+"out vec4 fragColor;\n"
+"void main()\n"
+"{\n"
+"    fragColor = vec4(vColor, 1.0);\n"
+"}\n";
+
+static const char * coreLitVertexText =
+"#version 330 core\n"
+"uniform mat4 projection;\n"
+"uniform mat4 model;\n"
+"uniform int variant;\n"
+"uniform vec3 color;\n"
+"in vec3 position;\n"
+"in vec3 normal;\n"
+"out vec3 vNormal;\n"
+"flat out vec3 vColor;\n"
+"flat out int vVariant;\n"
+"void main()\n"
+"{\n"
+"    vNormal = mat3(model) * normal;\n"
+"    vColor = color;\n"
+"    vVariant = variant;\n"
+"    gl_Position = projection * (model * vec4(position, 1.0));\n"
+"}\n";
+
+static const char * coreConeVertexText =
+"#version 330 core\n"
+"layout(std140) uniform Palette {\n"
+"    vec4 palette[64];\n"
+"};\n"
+"uniform mat4 projection;\n"
+"in vec3 position;\n"
+"in vec3 normal;\n"
+"in float instMaterial;\n"
+"in float instVariant;\n"
+"in mat4 instModel;\n"
+"out vec3 vNormal;\n"
+"flat out vec3 vColor;\n"
+"flat out int vVariant;\n"
+"void main()\n"
+"{\n"
+"    vNormal = mat3(instModel) * normal;\n"
+"    vColor = palette[int(instMaterial)].rgb;\n"
+"    vVariant = int(instVariant);\n"
+"    gl_Position = projection * (instModel * vec4(position, 1.0));\n"
+"}\n";
+
+/* LIGHT0 with an infinite viewer, as the fixed-function path lights it */
+static const char * coreLitFragmentText =
+"#version 330 core\n"
+"layout(std140) uniform Lights {\n"
+"    vec4 lightDir[4];\n"
+"    vec4 halfDir[4];\n"
+"    vec4 normalSign;\n"
+"    vec4 light;\n"
+"    vec4 ambient;\n"
+"};\n"
+"in vec3 vNormal;\n"
+"flat in vec3 vColor;\n"
+"flat in int vVariant;\n"
+"out vec4 fragColor;\n"
+"void main()\n"
+"{\n"
+"    vec3 n = normalSign[vVariant] * normalize(vNormal);\n"
+"    float nl = max(dot(n, lightDir[vVariant].xyz), 0.0);\n"
+"    float nh = max(dot(n, halfDir[vVariant].xyz), 0.0);\n"
+"    vec3 c = ambient.rgb + nl * light.rgb * (0.4 * vColor);\n"
+"    if (nl > 0.0) {\n"
+"        c += pow(nh, 50.0) * light.rgb * vColor;\n"
+"    }\n"
+"    fragColor = vec4(c, light.a);\n"
+"}\n";
+
+static void coreBindBlocks(GLuint program) {
+  GLuint index = glGetUniformBlockIndex(program,"Lights");
+  if (index != GL_INVALID_INDEX) {
+      glUniformBlockBinding(program,index,CORE_LIGHTS_BINDING);
+  }
+  index = glGetUniformBlockIndex(program,"Palette");
+  if (index != GL_INVALID_INDEX) {
+      glUniformBlockBinding(program,index,CORE_PALETTE_BINDING);
+  }
+}
+
+/* build the core programs and buffers; returns 0 if that fails */
+static int initCore(void) {
+  int i;
+  coreLineProgram = makeProgram(coreLineVertexText,coreLineFragmentText);
+  coreLitProgram = makeProgram(coreLitVertexText,coreLitFragmentText);
+  coreConeProgram = makeProgram(coreConeVertexText,coreLitFragmentText);
+  if (coreLineProgram == 0 || coreLitProgram == 0 || coreConeProgram == 0) {
+      return 0;
+  }
+  coreBindBlocks(coreLitProgram);
+  coreBindBlocks(coreConeProgram);
+  coreLineProjectionLoc = glGetUniformLocation(coreLineProgram,"projection");
+  coreLineModelLoc = glGetUniformLocation(coreLineProgram,"model");
+  coreLitProjectionLoc = glGetUniformLocation(coreLitProgram,"projection");
+  coreLitModelLoc = glGetUniformLocation(coreLitProgram,"model");
+  coreLitVariantLoc = glGetUniformLocation(coreLitProgram,"variant");
+  coreLitColorLoc = glGetUniformLocation(coreLitProgram,"color");
+  coreConeProjectionLoc = glGetUniformLocation(coreConeProgram,"projection");
+  glGenVertexArrays(1,& coreVao);
+  glBindVertexArray(coreVao);
+  glGenBuffers(1,& coreLightsBuffer);
+  glBindBuffer(GL_UNIFORM_BUFFER,coreLightsBuffer);
+  glBufferData(GL_UNIFORM_BUFFER,sizeof(coreLights),NULL,GL_DYNAMIC_DRAW);
+  glBindBufferBase(GL_UNIFORM_BUFFER,CORE_LIGHTS_BINDING,coreLightsBuffer);
+  GLfloat palette[MATERIALS][4];
+  memset(palette,0,sizeof(palette));
+  for (i = 0; i < materialCount; i += 1) {
+      memcpy(palette[i],materialTable[i],sizeof(palette[i]));
+  }
+  glGenBuffers(1,& corePaletteBuffer);
+  glBindBuffer(GL_UNIFORM_BUFFER,corePaletteBuffer);
+  glBufferData(GL_UNIFORM_BUFFER,sizeof(palette),palette,GL_STATIC_DRAW);
+  glBindBufferBase(GL_UNIFORM_BUFFER,CORE_PALETTE_BINDING,corePaletteBuffer);
+  glBindBuffer(GL_UNIFORM_BUFFER,0);
+  return 1;
+}
+
+/* draw count HUD vertices, already in eye space */
+static void coreDrawHud(GLenum mode, const hudVertex * verts, int count) {
+  GLfloat identity[16];
+  mat4Identity(identity);
+  STATS_CALL(glUseProgram(coreLineProgram));
+  STATS_CALL(glUniformMatrix4fv(coreLineProjectionLoc,1,GL_FALSE,projection));
+  STATS_CALL(glUniformMatrix4fv(coreLineModelLoc,1,GL_FALSE,identity));
+  GLintptr offset = streamWrite(verts,sizeof(hudVertex) * count);
+  STATS_CALL(glEnableVertexAttribArray(ATTRIB_POSITION));
+  STATS_CALL(glEnableVertexAttribArray(ATTRIB_COLOR));
+  STATS_CALL(glVertexAttribPointer(ATTRIB_POSITION,3,GL_FLOAT,GL_FALSE,sizeof(hudVertex),
+      (void *) (offset + offsetof(hudVertex,p))));
+  STATS_CALL(glVertexAttribPointer(ATTRIB_COLOR,3,GL_FLOAT,GL_FALSE,sizeof(hudVertex),
+      (void *) (offset + offsetof(hudVertex,c))));
+  STATS_DRAW(count,glDrawArrays(mode,0,count));
+  STATS_CALL(glDisableVertexAttribArray(ATTRIB_COLOR));
+  STATS_CALL(glDisableVertexAttribArray(ATTRIB_POSITION));
+  STATS_CALL(glBindBuffer(GL_ARRAY_BUFFER,0));
+  STATS_CALL(glUseProgram(0));
+}
+
+/* the scene batch and the Sols for every enabled variant; root is the
+   eye-space scene root */
+static void coreDrawScene(const GLfloat * root) {
+  coreLights lights;
+  GLfloat model[16];
+  int v,i,base = 0;
+  memset(& lights,0,sizeof(lights));
+  for (v = 0; v < VARIANTS; v += 1) {
+      variantDirs(v,lights.lightDir[v],lights.halfDir[v]);
+      lights.normalSign[v] = variantFlip(v) ? -1.0 : 1.0;
+  }
+  lights.light[0] = lights.light[1] = lights.light[2] = 1.0;
+  lights.light[3] = frame->matAlpha;
+  lights.ambient[0] = lights.ambient[1] = lights.ambient[2] = 0.2 * 0.2;
+  STATS_CALL(glBindBuffer(GL_UNIFORM_BUFFER,coreLightsBuffer));
+  STATS_CALL(glBufferSubData(GL_UNIFORM_BUFFER,0,sizeof(lights),& lights));
+  STATS_CALL(glBindBuffer(GL_UNIFORM_BUFFER,0));
+  STATS_CALL(glEnableVertexAttribArray(ATTRIB_POSITION));
+  /* unlit runs take their color from the constant color attribute */
+  STATS_CALL(glUseProgram(coreLineProgram));
+  STATS_CALL(glUniformMatrix4fv(coreLineProjectionLoc,1,GL_FALSE,projection));
+  for (v = 0; v < VARIANTS; v += 1) {
+      if (!(mirrorMask & (1 << v))) {
+          continue;
+      }
+      mirrorMatrix(model,root,v);
+      STATS_CALL(glUniformMatrix4fv(coreLineModelLoc,1,GL_FALSE,model));
+      for (i = 0; i < batchRunCount; i += 1) {
+          batchRun * r = & batchRuns[i];
+          if (i == 0 || i == batchStaticRuns) {
+              base = batchSource(i >= batchStaticRuns,0);
+          }
+          if (!r->material && r->count > 0 && !r->culled) {
+              STATS_CALL(glVertexAttrib3fv(ATTRIB_COLOR,r->color));
+              STATS_DRAW(r->count,glDrawArrays(r->mode,r->first - base,r->count));
+              stats.triangles += r->mode == GL_TRIANGLES ? r->count / 3 : 0;
+          }
+      }
+  }
+  STATS_CALL(glEnableVertexAttribArray(ATTRIB_NORMAL));
+  STATS_CALL(glUseProgram(coreLitProgram));
+  STATS_CALL(glUniformMatrix4fv(coreLitProjectionLoc,1,GL_FALSE,projection));
+  for (v = 0; v < VARIANTS; v += 1) {
+      if (!(mirrorMask & (1 << v))) {
+          continue;
+      }
+      mirrorMatrix(model,root,v);
+      STATS_CALL(glUniformMatrix4fv(coreLitModelLoc,1,GL_FALSE,model));
+      STATS_CALL(glUniform1i(coreLitVariantLoc,v));
+      for (i = 0; i < batchRunCount; i += 1) {
+          batchRun * r = & batchRuns[i];
+          if (i == 0 || i == batchStaticRuns) {
+              base = batchSource(i >= batchStaticRuns,0);
+          }
+          if (r->material && r->count > 0 && !r->culled) {
+              STATS_CALL(glUniform3fv(coreLitColorLoc,1,r->material));
+              STATS_DRAW(r->count,glDrawArrays(r->mode,r->first - base,r->count));
+              stats.triangles += r->mode == GL_TRIANGLES ? r->count / 3 : 0;
+          }
+      }
+  }
+  STATS_CALL(glDisableVertexAttribArray(ATTRIB_NORMAL));
+  STATS_CALL(glDisableVertexAttribArray(ATTRIB_POSITION));
+  STATS_CALL(glBindBuffer(GL_ARRAY_BUFFER,0));
+  int active = uploadSols();
+  STATS_CALL(glUseProgram(coreConeProgram));
+  STATS_CALL(glUniformMatrix4fv(coreConeProjectionLoc,1,GL_FALSE,projection));
+  drawSolInstances(active);
+  STATS_CALL(glUseProgram(0));
+}
+
+/* HUD lines.  draw1() and the statistics overlay draw through these.
+   Each begin/end block is collected and drawn from the streaming
+   buffer, by coreDrawHud() in the core renderer. */
+static hudVertex * hudVerts = NULL;
+static int hudLength = 0;
+static int hudAlloc = 0;
+static GLenum hudMode;
+static GLfloat hudRGB[3];
+
+static void hudBegin(GLenum mode) {
+  hudMode = mode;
+  hudLength = 0;
+}
+
+static void hudColor3f(GLfloat r, GLfloat g, GLfloat b) {
+  hudRGB[0] = r;
+  hudRGB[1] = g;
+  hudRGB[2] = b;
+}
+
+static void hudColor3fv(const GLfloat * c) {
+  hudColor3f(c[0],c[1],c[2]);
+}
+
+static void hudVertex3f(GLfloat x, GLfloat y, GLfloat z) {
+  if (hudLength == hudAlloc) {
+      hudAlloc = hudAlloc ? 2 * hudAlloc : 256;
+      hudVerts = realloc(hudVerts,sizeof(hudVertex) * hudAlloc);
+  }
+  hudVertex * v = & hudVerts[hudLength];
+  hudLength += 1;
+  v->p[0] = x;
+  v->p[1] = y;
+  v->p[2] = z;
+  memcpy(v->c,hudRGB,sizeof(v->c));
+}
+
+static void hudEnd(void) {
+  if (hudLength == 0) {
+      return;
+  }
+  if (useCore) {
+      coreDrawHud(hudMode,hudVerts,hudLength);
+      return;
+  }
+  GLintptr offset = streamWrite(hudVerts,sizeof(hudVertex) * hudLength);
+  STATS_CALL(glEnableClientState(GL_VERTEX_ARRAY));
+  STATS_CALL(glEnableClientState(GL_COLOR_ARRAY));
+  STATS_CALL(glVertexPointer(3,GL_FLOAT,sizeof(hudVertex),
+      (void *) (offset + offsetof(hudVertex,p))));
+  STATS_CALL(glColorPointer(3,GL_FLOAT,sizeof(hudVertex),
+      (void *) (offset + offsetof(hudVertex,c))));
+  STATS_DRAW(hudLength,glDrawArrays(hudMode,0,hudLength));
+  STATS_CALL(glDisableClientState(GL_COLOR_ARRAY));
+  STATS_CALL(glDisableClientState(GL_VERTEX_ARRAY));
+  STATS_CALL(glBindBuffer(GL_ARRAY_BUFFER,0));
+}
+
 double cursor2x;
 double cursor2y;
+
+static int statsCompare(const void * a, const void * b) {
+  double x = * (const double *) a;
+  double y = * (const double *) b;
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/* p50, p95 and p99 of the frame times in the ring */
+static void statsPercentiles(double * pct) {
+  double sorted[STATS_FRAMES];
+  int n = statsCount < STATS_FRAMES ? (int) statsCount : STATS_FRAMES;
+  int i;
+  if (n == 0) {
+      pct[0] = pct[1] = pct[2] = 0.0;
+      return;
+  }
+  for (i = 0; i < n; i += 1) {
+      sorted[i] = statsRing[i].frameTime;
+  }
+  qsort(sorted,n,sizeof(double),statsCompare);
+  pct[0] = sorted[(n - 1) * 50 / 100];
+  pct[1] = sorted[(n - 1) * 95 / 100];
+  pct[2] = sorted[(n - 1) * 99 / 100];
+}
+
+/* start or stop writing one CSV row per frame */
+static void statsToggleCsv(void) {
+  if (statsCsv) {
+      fclose(statsCsv);
+      statsCsv = NULL;
+      printf("stopped writing '%s'\n",STATS_CSV_FILENAME);
+  } else {
+      statsCsv = fopen(STATS_CSV_FILENAME,"w");
+      if (! statsCsv) {
+          fprintf(stderr,"cannot write '%s'\n",STATS_CSV_FILENAME);
+          return;
+      }
+      fprintf(statsCsv,"frame,frame_ms,p50_ms,p95_ms,p99_ms,animate_ms,draw1_ms,"
+          "draw2_ms,mirror_ms,swap_ms,vertices,draw_calls,gl_calls,materials_elided,culled\n");
+      printf("writing frame statistics to '%s'\n",STATS_CSV_FILENAME);
+  }
+  fflush(stdout);
+}
+
 int dc = 0; // draw frame counter
+
+/* close the current frame; call right after the swap */
+static void statsEnd(void) {
+  double now = glfwGetTime();
+  int p;
+  stats.frameTime = statsSwap >= 0.0 ? now - statsSwap : 0.0;
+  statsSwap = now;
+  statsRing[statsCount % STATS_FRAMES] = stats;
+  statsCount += 1;
+  if (statsCsv) {
+      double pct[3];
+      statsPercentiles(pct);
+      fprintf(statsCsv,"%d,%.3f,%.3f,%.3f,%.3f",dc,1000.0 * stats.frameTime,
+          1000.0 * pct[0],1000.0 * pct[1],1000.0 * pct[2]);
+      for (p = 0; p < PHASES; p += 1) {
+          fprintf(statsCsv,",%.3f",1000.0 * stats.phase[p]);
+      }
+      fprintf(statsCsv,",%ld,%ld,%ld,%ld,%ld\n",stats.vertices,stats.drawCalls,stats.glCalls,
+          stats.materialsElided,stats.culled);
+  }
+  memset(& stats,0,sizeof(stats));
+  statsMark = now;
+}
+
+/* seven-segment digits; bit 0 is the top segment, then clockwise, bit 6 the middle */
+static const unsigned char segments[10] = {0x3f,0x06,0x5b,0x4f,0x66,0x6d,0x7d,0x07,0x7f,0x6f};
+
+/* draw text (digits, '.' and ' ') as GL_LINES with its lower left at x,y */
+static void drawDigits(double x, double y, double h, const char * text, double z) {
+  double w = 0.5 * h;
+  for (; *text; text += 1) {
+      if (*text == '.') {
+          hudVertex3f(x,y,z);
+          hudVertex3f(x,y + 0.1 * h,z);
+          x += 0.3 * w;
+          continue;
+      }
+      if (*text >= '0' && *text <= '9') {
+          /* segment end points: a b c d e f g */
+          static const float seg[7][4] = {
+              {0,1,1,1},{1,1,1,0.5},{1,0.5,1,0},{0,0,1,0},
+              {0,0,0,0.5},{0,0.5,0,1},{0,0.5,1,0.5}};
+          unsigned char bits = segments[*text - '0'];
+          int k;
+          for (k = 0; k < 7; k += 1) {
+              if (bits & (1 << k)) {
+                  hudVertex3f(x + w * seg[k][0],y + h * seg[k][1],z);
+                  hudVertex3f(x + w * seg[k][2],y + h * seg[k][3],z);
+              }
+          }
+      }
+      x += 1.6 * w;
+  }
+}
+
+/* Frame-time graph in the upper right HUD frame, numbers in the lower right:
+     row 1  frame time p50 p95 p99 (ms)
+     row 2  animate draw1 draw2 mirror swap (ms, mean over the ring)
+     row 3  vertices, draw calls, GL calls, elided material changes and
+            culled objects of the last frame */
+static void drawStats(float z) {
+  double pct[3];
+  double mean[PHASES] = {0.0};
+  int n = statsCount < STATS_FRAMES ? (int) statsCount : STATS_FRAMES;
+  int i,p;
+  if (n == 0) return;
+  statsPercentiles(pct);
+  for (i = 0; i < n; i += 1) {
+      for (p = 0; p < PHASES; p += 1) {
+          mean[p] += statsRing[i].phase[p] / n;
+      }
+  }
+  const frameStats * last = & statsRing[(statsCount - 1) % STATS_FRAMES];
+  /* graph: 1 .. HUDscale covers 0 .. 50 ms */
+  double gx = 1.0, gw = xHUDscale - 1.0;
+  double gy = 1.0, gh = HUDscale - 1.0;
+  double msScale = gh / 50.0;
+  hudBegin(GL_LINE_STRIP);
+  hudColor3f(0.8,0.8,0.8);
+  for (i = 0; i < n; i += 1) {
+      const frameStats * fs = & statsRing[(statsCount - n + i) % STATS_FRAMES];
+      double ms = 1000.0 * fs->frameTime;
+      ms = ms > 50.0 ? 50.0 : ms;
+      hudVertex3f(gx + gw * i / (STATS_FRAMES - 1),gy + msScale * ms,z);
+  }
+  hudEnd();
+  static const GLfloat pctColor[3][3] = {{0.1,0.8,0.1},{0.8,0.8,0.1},{0.8,0.1,0.1}};
+  hudBegin(GL_LINES);
+  hudColor3f(0.1,0.4,0.8);
+  hudVertex3f(gx,gy + msScale * 1000.0 / paceRate,z);
+  hudVertex3f(gx + gw,gy + msScale * 1000.0 / paceRate,z);
+  for (i = 0; i < 3; i += 1) {
+      double ms = 1000.0 * pct[i];
+      ms = ms > 50.0 ? 50.0 : ms;
+      hudColor3fv(pctColor[i]);
+      hudVertex3f(gx,gy + msScale * ms,z);
+      hudVertex3f(gx + gw,gy + msScale * ms,z);
+  }
+  /* numbers */
+  char text[64];
+  double h = 0.4, x, y = -1.0 - 1.5 * h;
+  for (i = 0, x = 1.2; i < 3; i += 1, x += 2.0) {
+      hudColor3fv(pctColor[i]);
+      snprintf(text,sizeof(text),"%.1f",1000.0 * pct[i]);
+      drawDigits(x,y,h,text,z);
+  }
+  y -= 1.5 * h;
+  hudColor3f(0.8,0.8,0.8);
+  for (p = 0, x = 1.2; p < PHASES; p += 1, x += 1.5) {
+      snprintf(text,sizeof(text),"%.1f",1000.0 * mean[p]);
+      drawDigits(x,y,0.75 * h,text,z);
+  }
+  y -= 1.5 * h;
+  snprintf(text,sizeof(text),"%ld %ld %ld %ld %ld",last->vertices,last->drawCalls,
+      last->glCalls,last->materialsElided,last->culled);
+  drawDigits(1.2,y,h,text,z);
+  hudEnd();
+}
+
 static double bgColor[3] = {0.7225,0.8325,0.9425};
 /* OpenGL draw function & timing */
 static void draw1(void) {
@@ -372,139 +2284,130 @@ static void draw1(void) {
   double bgColorShade[3];
   int i;
   for (i = 0;i < 3;i += 1) {
-      bgColorShade[i] = (1.0 - matAlpha) * matAlpha * bgColor[i];
+      bgColorShade[i] = (1.0 - frame->matAlpha) * frame->matAlpha * bgColor[i];
   }
-  glClearColor(bgColorShade[0],bgColorShade[1],bgColorShade[2],1.0 - matAlpha);
-  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  STATS_CALL(glClearColor(bgColorShade[0],bgColorShade[1],bgColorShade[2],1.0 - frame->matAlpha));
+  STATS_CALL(glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT));
   gearMaterial(GL_FRONT, skyblue);
-  glDisable(GL_LIGHTING);
-  glDisable(GL_LIGHT0);
-  glDisable(GL_LIGHT1);
-  glDisable(GL_LIGHT2);
-  glDisable(GL_LIGHT3);
+  if (!useCore) {
+      STATS_CALL(glDisable(GL_LIGHTING));
+      STATS_CALL(glDisable(GL_LIGHT0));
+      STATS_CALL(glDisable(GL_LIGHT1));
+      STATS_CALL(glDisable(GL_LIGHT2));
+      STATS_CALL(glDisable(GL_LIGHT3));
+  }
 
   float HUDz = -18.0;
-  glBegin(GL_LINES); /* HUD outlines */
-  glColor3f(0.1,0.4,0.8); /* set HUD color 1 */
-  glVertex3f(1.0      ,1.0     , HUDz);
-  glVertex3f(xHUDscale,1.0     , HUDz);
-  glVertex3f(1.0      ,HUDscale, HUDz);
-  glVertex3f(xHUDscale,HUDscale, HUDz);
-  glVertex3f(1.0      ,1.0     , HUDz);
-  glVertex3f(1.0      ,HUDscale, HUDz);
-  glVertex3f(xHUDscale,1.0     , HUDz);
-  glVertex3f(xHUDscale,HUDscale, HUDz);
-  glColor3f(0.8,0.4,0.1); /* set HUD color 2 */
-  glVertex3f(1.0      ,-1.0     , HUDz);
-  glVertex3f(xHUDscale,-1.0     , HUDz);
-  glVertex3f(1.0      ,-HUDscale, HUDz);
-  glVertex3f(xHUDscale,-HUDscale, HUDz);
-  glVertex3f(1.0      ,-1.0     , HUDz);
-  glVertex3f(1.0      ,-HUDscale, HUDz);
-  glVertex3f(xHUDscale,-1.0     , HUDz);
-  glVertex3f(xHUDscale,-HUDscale, HUDz);
-  glColor3f(0.1,0.8,0.1); /* set HUD color 3 */
-  glVertex3f(-1.0      ,-1.0     , HUDz);
-  glVertex3f(-xHUDscale,-1.0     , HUDz);
-  glVertex3f(-1.0      ,-HUDscale, HUDz);
-  glVertex3f(-xHUDscale,-HUDscale, HUDz);
-  glVertex3f(-1.0      ,-1.0     , HUDz);
-  glVertex3f(-1.0      ,-HUDscale, HUDz);
-  glVertex3f(-xHUDscale,-1.0     , HUDz);
-  glVertex3f(-xHUDscale,-HUDscale, HUDz);
-  glColor3f(0.8,0.8,0.1); /* set HUD color 4 */
-  glVertex3f(-1.0      ,1.0     , HUDz);
-  glVertex3f(-xHUDscale,1.0     , HUDz);
-  glVertex3f(-1.0      ,HUDscale, HUDz);
-  glVertex3f(-xHUDscale,HUDscale, HUDz);
-  glVertex3f(-1.0      ,1.0     , HUDz);
-  glVertex3f(-1.0      ,HUDscale, HUDz);
-  glVertex3f(-xHUDscale,1.0     , HUDz);
-  glVertex3f(-xHUDscale,HUDscale, HUDz);
-  glEnd(); /* end HUD */
-
-  glBegin(GL_LINES);
-  glColor3f(0.8,0.8,0.8);
-  glVertex3f(0.0,0.0,HUDz);
-  glVertex3f(xHUDscale,0.0,HUDz);
-  glVertex3f(0.0,0.0,HUDz);
-  glVertex3f(-xHUDscale,0.0,HUDz);
-  glVertex3f(0.0,0.0,HUDz);
-  glVertex3f(0.0,HUDscale,HUDz);
-  glVertex3f(0.0,0.0,HUDz);
-  glVertex3f(0.0,-HUDscale,HUDz);
-  glEnd();
+  hudBegin(GL_LINES); /* HUD outlines */
+  hudColor3f(0.1,0.4,0.8); /* set HUD color 1 */
+  hudVertex3f(1.0      ,1.0     , HUDz);
+  hudVertex3f(xHUDscale,1.0     , HUDz);
+  hudVertex3f(1.0      ,HUDscale, HUDz);
+  hudVertex3f(xHUDscale,HUDscale, HUDz);
+  hudVertex3f(1.0      ,1.0     , HUDz);
+  hudVertex3f(1.0      ,HUDscale, HUDz);
+  hudVertex3f(xHUDscale,1.0     , HUDz);
+  hudVertex3f(xHUDscale,HUDscale, HUDz);
+  hudColor3f(0.8,0.4,0.1); /* set HUD color 2 */
+  hudVertex3f(1.0      ,-1.0     , HUDz);
+  hudVertex3f(xHUDscale,-1.0     , HUDz);
+  hudVertex3f(1.0      ,-HUDscale, HUDz);
+  hudVertex3f(xHUDscale,-HUDscale, HUDz);
+  hudVertex3f(1.0      ,-1.0     , HUDz);
+  hudVertex3f(1.0      ,-HUDscale, HUDz);
+  hudVertex3f(xHUDscale,-1.0     , HUDz);
+  hudVertex3f(xHUDscale,-HUDscale, HUDz);
+  hudColor3f(0.1,0.8,0.1); /* set HUD color 3 */
+  hudVertex3f(-1.0      ,-1.0     , HUDz);
+  hudVertex3f(-xHUDscale,-1.0     , HUDz);
+  hudVertex3f(-1.0      ,-HUDscale, HUDz);
+  hudVertex3f(-xHUDscale,-HUDscale, HUDz);
+  hudVertex3f(-1.0      ,-1.0     , HUDz);
+  hudVertex3f(-1.0      ,-HUDscale, HUDz);
+  hudVertex3f(-xHUDscale,-1.0     , HUDz);
+  hudVertex3f(-xHUDscale,-HUDscale, HUDz);
+  hudColor3f(0.8,0.8,0.1); /* set HUD color 4 */
+  hudVertex3f(-1.0      ,1.0     , HUDz);
+  hudVertex3f(-xHUDscale,1.0     , HUDz);
+  hudVertex3f(-1.0      ,HUDscale, HUDz);
+  hudVertex3f(-xHUDscale,HUDscale, HUDz);
+  hudVertex3f(-1.0      ,1.0     , HUDz);
+  hudVertex3f(-1.0      ,HUDscale, HUDz);
+  hudVertex3f(-xHUDscale,1.0     , HUDz);
+  hudVertex3f(-xHUDscale,HUDscale, HUDz);
+  hudEnd(); /* end HUD */
+
+  hudBegin(GL_LINES);
+  hudColor3f(0.8,0.8,0.8);
+  hudVertex3f(0.0,0.0,HUDz);
+  hudVertex3f(xHUDscale,0.0,HUDz);
+  hudVertex3f(0.0,0.0,HUDz);
+  hudVertex3f(-xHUDscale,0.0,HUDz);
+  hudVertex3f(0.0,0.0,HUDz);
+  hudVertex3f(0.0,HUDscale,HUDz);
+  hudVertex3f(0.0,0.0,HUDz);
+  hudVertex3f(0.0,-HUDscale,HUDz);
+  hudEnd();
+  if (statsOverlay) {
+      drawStats(HUDz);
+  }
 }
 
-static void draw2(void) {
+/* record the grid, platforms and marquee, which never change, as the
+   static runs of the scene batch */
+static void bakeScene(void) {
   int i;
-  glDisable(GL_LIGHTING);
-  glDisable(GL_LIGHT0);
-  glDisable(GL_LIGHT1);
-  glDisable(GL_LIGHT2);
-  glDisable(GL_LIGHT3);
-  glPushMatrix(); /* scene */
-  camDip = 5.0;
-  glRotatef(camDip, 1.0, 0.0, 0.0);
-  glTranslatef(0.0,0.0,-range);
-  glRotatef(view_rotx, 1.0, 0.0, 0.0);
-  glRotatef(view_roty, 0.0, 1.0, 0.0);
-  glTranslatef(0.0,camHeight,0.0);
-  glRotatef(fmod(sceneAngle,360.0), 0.0, 1.0, 0.0);
-  glTranslatef(floorOffset,0.0,floorOffset);
-  glTranslatef(0.0, -4.0, 0.0);
-  glPushMatrix(); /* (green grid, cursor, marquee, Sol) */
-
-  glBegin(GL_LINES); /* green grid */
+  msLoadIdentity(); /* relative to the scene root */
+  batchReset();
+
+  batchBegin(GL_LINES,NULL); /* green grid */
   if (1) {
-      glColor3f(0.1,0.8,0.1);
+      batchColor3f(0.1,0.8,0.1);
       for (i = 0; i < 10; i += 1) {
-          glVertex3f( 0.0 , (double) i, 0.0);
-          glVertex3f( 10.0, (double) i, 0.0);
+          batchVertex3f( 0.0 , (double) i, 0.0);
+          batchVertex3f( 10.0, (double) i, 0.0);
       }
       for (i = 0; i < 10; i += 1) {
-          glVertex3f((double) i, 0.0 , 0.0);
-          glVertex3f((double) i, 10.0, 0.0);
+          batchVertex3f((double) i, 0.0 , 0.0);
+          batchVertex3f((double) i, 10.0, 0.0);
       }
-      glEnd(); /* end green grid */
-      glColor3f(0.1,0.1,0.8);
-      glBegin(GL_LINES); /* blue grid */
+      /* end green grid */
+      batchBegin(GL_LINES,NULL); /* blue grid */
+      batchColor3f(0.1,0.1,0.8);
       for (i = 0; i < 10; i += 1) {
-          glVertex3f( 0.0 , 0.0, (double) i);
-          glVertex3f( 10.0, 0.0, (double) i);
+          batchVertex3f( 0.0 , 0.0, (double) i);
+          batchVertex3f( 10.0, 0.0, (double) i);
       }
       for (i = 0; i < 10; i += 1) {
-          glVertex3f((double) i, 0.0 , 0.0);
-          glVertex3f((double) i, 0.0, 10.0);
+          batchVertex3f((double) i, 0.0 , 0.0);
+          batchVertex3f((double) i, 0.0, 10.0);
       }
-      glEnd(); /* end blue grid */
+      /* end blue grid */
   }
-  glTranslatef(0.0, 4.0, 0.0);
-  glEnable(GL_LIGHTING);
-  glEnable(GL_LIGHT0);
-  glPushMatrix(); /* (cursor, cursor 2, marquee) */
-  gearMaterial(GL_FRONT, cerulean);
+  msTranslatef(0.0, 4.0, 0.0);
   double sideWidth = 6.0;
   double platHeight = 1.0;
   double sideWidth2 = 3.0;
   double platHeight2 = 0.125;
   double platRange = 4.0;
   for (i = 0;i < 4;i += 1) {
-      glPushMatrix(); /* platform */
+      msPushMatrix(); /* platform */
       if (i == 1) {
-          glRotatef(90.0,0.0,0.0,1.0);
-          glRotatef(180.0,1.0,0.0,0.0);
+          msRotatef(90.0,0.0,0.0,1.0);
+          msRotatef(180.0,1.0,0.0,0.0);
           sideWidth = sideWidth2;
           platHeight = platHeight2;
       } else if (i == 2) {
-          glRotatef(90.0,0.0,1.0,0.0);
-          glRotatef(180.0,1.0,0.0,0.0);
+          msRotatef(90.0,0.0,1.0,0.0);
+          msRotatef(180.0,1.0,0.0,0.0);
       } else if (i == 3) {
-          glRotatef(90.0,1.0,0.0,0.0);
-          glRotatef(180.0,0.0,1.0,0.0);
+          msRotatef(90.0,1.0,0.0,0.0);
+          msRotatef(180.0,0.0,1.0,0.0);
       }
-      glTranslatef(0.0,-platRange,0.0);
-      glBegin(GL_TRIANGLES); /* platform */
+      msTranslatef(0.0,-platRange,0.0);
+      batchBegin(GL_TRIANGLES,cerulean); /* one run per platform, to cull */
+      batchBound(0.5 * sideWidth,-0.5 * platHeight,0.5 * sideWidth,
+          sqrt(0.5 * sideWidth * sideWidth + 0.25 * platHeight * platHeight));
       triNorm(
            0.0,0.0, 0.0,
            0.0,0.0,sideWidth,
@@ -554,17 +2457,11 @@ static void draw2(void) {
            sideWidth, 0.0,sideWidth,
            sideWidth,-platHeight,sideWidth);
 
-      glEnd(); /* end platform */
-      glPopMatrix(); /* end platform */
+      msPopMatrix(); /* end platform */
   }
-  gearMaterial(GL_FRONT, pink);
+  batchBegin(GL_TRIANGLES,pink);
   int Rwidth = 1;
   for (i = 0; i < 1; i += 1) {
-      glBegin(GL_TRIANGLES); /* Draw cursor */
-      drawboldline2(xCursor - 0.5, yCursor - 0.5,xCursor + 0.5, yCursor + 0.5);
-      drawboldline2(xCursor - 0.5, yCursor + 0.5,xCursor + 0.5, yCursor - 0.5);
-      drawboldline2(0.0,0.0,xCursor,yCursor);
-      /* end cursor */
       /* Draw marquee R */
       drawboldline2(0.0         ,4.0,0.0 + Rwidth,4.0);
       drawboldline2(0.0 + Rwidth,4.0,1.0 + Rwidth,3.0);
@@ -573,181 +2470,108 @@ static void draw2(void) {
       drawboldline2(0.0         ,4.0,0.0         ,0.0);
       drawboldline2(0.0 + Rwidth,2.0,1.0 + Rwidth,1.0);
       drawboldline2(1.0 + Rwidth,1.0,1.0 + Rwidth,0.0);
-      glEnd(); /* end marquee R */
-      glRotatef(45.0,0.0,1.0,0.0);
+      /* end marquee R */
   }
-  glPopMatrix(); /* (cursor, marquee) */
-  int j,k;
-  int p1,p2,p3;
-  // Draw Sol
-  int ci = 0;
-  int div = 5;
-  // Cone figure parameters
-  double xx[FACES];
-  double yy[FACES];
-  // line segments define arc of cone base
-  yy[0] = xx[8] = 0.0;
-  yy[1] = xx[7] = 0.19509032201612825;
-  yy[2] = xx[6] = 0.3826834323650898;
-  yy[3] = xx[5] = 0.5555702330196022;
-  yy[4] = xx[4] = 0.7071067811865475;
-  yy[5] = xx[3] = 0.8314696123025451;
-  yy[6] = xx[2] = 0.9238795325112867;
-  yy[7] = xx[1] = 0.9807852804032304;
-  yy[8] = xx[0] = 1.0;
-  for (i = 0; i < FACES; i += 1) {
-    xx[i] *= spikeRadius;
-    yy[i] *= spikeRadius;
-  }
-  double sunRadius2[2];
-  sunRadius2[0] = 1.25;
-  sunRadius2[1] = 0.45;
-  int ii;
-  for (ii = 0; ii < FACES - 1;ii += 1) {
-    triNormc(& t1[ii],xx[ii],0.0,yy[ii],0.0,sunRadius2[0],0.0,xx[ii + 1],0.0,yy[ii + 1]);
-    // end cap A
-    triNormc(& t2[ii],0.0,-sunRadius2[1],0.0,xx[ii + 0],0.0,yy[ii + 0],xx[ii + 1],0.0,yy[ii + 1]);
-    triNormc(& t3[ii],-xx[ii],0.0,yy[ii],-xx[ii + 1],0.0,yy[ii + 1],0.0,sunRadius2[0],0.0);
-    // end cap B
-    triNormc(& t4[ii],-xx[ii],0.0,yy[ii],0.0,-sunRadius2[1],0.0,-xx[ii + 1],0.0,yy[ii + 1]);
-  }
-  sunRadius2[0] = 0.95;
-  sunRadius2[1] = 0.15;
-  for (ii = 0; ii < FACES - 1;ii += 1) {
-    triNormc(& u1[ii],xx[ii],0.0,yy[ii],0.0,sunRadius2[0],0.0,xx[ii + 1],0.0,yy[ii + 1]);
-    // end cap A
-    triNormc(& u2[ii],0.0,-sunRadius2[1],0.0,xx[ii + 0],0.0,yy[ii + 0],xx[ii + 1],0.0,yy[ii + 1]);
-    triNormc(& u3[ii],-xx[ii],0.0,yy[ii],-xx[ii + 1],0.0,yy[ii + 1],0.0,sunRadius2[0],0.0);
-    // end cap B
-    triNormc(& u4[ii],-xx[ii],0.0,yy[ii],0.0,-sunRadius2[1],0.0,-xx[ii + 1],0.0,yy[ii + 1]);
-  }
-  // obtain first rotation matrix
-  double theta1[16];
-  glPushMatrix();
-  glLoadIdentity();
-  glRotatef(fmod(60.0 + sunAngle3/64.0,360.0),1.0,0.0,0.0);
-  glGetDoublev(GL_MODELVIEW_MATRIX,theta1);
-  glPopMatrix();
-  // obtain second rotation matrix
-  double theta2[16];
-  glPushMatrix();
-  glLoadIdentity();
-  glRotatef(fmod(45.0 + sunAngle3/27.0,360.0),0.0,0.0,1.0);
-  glGetDoublev(GL_MODELVIEW_MATRIX,theta2);
-  glPopMatrix();
-  // Calculate the number of cones
-  int CONES = ((float) CONE_MIN) + ((float) CONE_DELTA) * WARM2;
-  CONES = CONES <= 0 ? 0 : CONES;
-  CONES = CONES >= (CONE_MIN + CONE_DELTA) ? (CONE_MIN + CONE_DELTA) : CONES;
-  double solscale = 2.0 * fabs(FAST2 - 0.5);
-  double disp = 2.75;
-  double disp2 = 2 * disp;
-  double mobileWave;
-  double asgn,bsgn,csgn;
-  int copy;
-  int fr;
-  for (p1 = 0; p1 < div; p1 += 1) {
-    for (p2 = 0; p2 < div; p2 += 1) {
-      for (p3 = 0; p3 < div; p3 += 1) {
-        ci += 1;
-        for (fr = 0; fr < 2; fr += 1) {
-          int outerp = p1 % 2 == 0 && p2 % 2 == 0 && p3 % 2 == 0;
-          int outerp2 = ( (p1 + p2 + p3) / 2) % 2 == 0;
-          int innerp = p1 >= 1 && p1 <= 3 && p2 >= 1 && p2 <= 3 && p3 >= 1 && p3 <= 3;
-          int innerp2 = (p1 + p2 + p3) % 5 == 4;
-          if ( !( (outerp && outerp2) || (innerp && innerp2) ) ) {
-              continue;
-          }
-          glPushMatrix(); /* Sol */
-          glScalef(solscale,solscale,solscale);
-          glTranslatef(0.0, (float) 5.0 * fr, 0.0);
-          float sx = 0.5 / ((float) 1.0 + 2.0 * fr);
-          glScalef(sx,sx,sx);
-          if (fr == 1) {
-              glScalef(-1.0,-1.0,1.0);
-          }
-          glTranslatef(-disp2 + disp * p1,-disp2 + disp * p2,-disp2 + disp * p3);
-          int rsgn = 1;
-          if (ci % 2 == 0) {
-              rsgn = -1;
-          }
-          asgn = bsgn = csgn = 0.0;
-          if (ci % 6 < 2) {
-              asgn = 1.0;
-          } else if (ci % 6 < 4) {
-              bsgn = 1.0;
-          } else {
-              csgn = 1.0;
-          }
-          glRotatef(fmod(rsgn * sunAngle2,360.0),asgn,bsgn,csgn);
-          if ( innerp ) {
-              mobileWave = sin(fmod(gearsGetTime(4),2.0 * M_PI));
-              glTranslatef(mobileWave,0.0,0.0);
-              glScalef(0.9,0.9,0.9);
-              copy = 2;
-          } else if ( outerp ) {
-              mobileWave = 0.25 * cos(fmod(gearsGetTime(4),2.0 * M_PI));
-              glTranslatef(0.0,mobileWave,0.0);
-              glScalef(0.6,0.6,0.6);
-              copy = 3;
-          }
-          for (k = 0;k < CONES;k += 1) {
-            if ( k == CONES / 2 ) {
-                glRotatef(VENUS2 * 180.0,1.0,0.0,0.0);
-            }
-            if (outerp) {
-                gearMaterial(GL_FRONT, sbPalette(pa2,k));
-            } else if (ci % 2 == 0) {
-                gearMaterial(GL_FRONT, sbPalette(pa1,k));
-            } else {
-                gearMaterial(GL_FRONT, sbPalette(pa3,k));
-            }
-            for (j = 0;j < copy;j += 1) {
-              glPushMatrix(); // fold
-              glTranslatef(0.0,sunRadius,0.0);
-              glScalef(2.0,2.0,2.0);
-              glMultMatrixd(theta1);
-              for (i = 0; i < 2; i += 1) {
-                glBegin(GL_TRIANGLES);
-                for (ii = 0; ii < FACES - 1; ii += 1) {
-                  if ( innerp ) {
-                    triNormd(& t1[ii]);
-                    triNormd(& t2[ii]);
-                    triNormd(& t3[ii]);
-                    triNormd(& t4[ii]);
-                  } else if ( outerp ) {
-                    triNormd(& u1[ii]);
-                    triNormd(& u2[ii]);
-                    triNormd(& u3[ii]);
-                    triNormd(& u4[ii]);
-                  }
-                }
-                glEnd();
-                glScalef(-1.0,1.0,-1.0);
-              }
-              glPopMatrix(); // end fold
-              glMultMatrixd(theta2);
-              glTranslatef(0.1,0.0,0.0);
-            }
-            glMultMatrixd(theta1);
-          }
-          glPopMatrix(); /* end Sol */
-        }
+  batchBake();
+}
+
+/* traverse the scene once and draw it for every enabled mirror variant */
+static void draw2(void) {
+  if (!useCore) {
+      STATS_CALL(glDisable(GL_LIGHTING));
+      STATS_CALL(glDisable(GL_LIGHT0));
+      STATS_CALL(glDisable(GL_LIGHT1));
+      STATS_CALL(glDisable(GL_LIGHT2));
+      STATS_CALL(glDisable(GL_LIGHT3));
+  }
+  msLoadIdentity();
+  msPushMatrix(); /* scene */
+  camDip = 5.0;
+  msRotatef(camDip, 1.0, 0.0, 0.0);
+  msTranslatef(0.0,0.0,-range);
+  msRotatef(view_rotx, 1.0, 0.0, 0.0);
+  msRotatef(view_roty, 0.0, 1.0, 0.0);
+  msTranslatef(0.0,camHeight,0.0);
+  msRotatef(fmod(frame->sceneAngle,360.0), 0.0, 1.0, 0.0);
+  msTranslatef(floorOffset,0.0,floorOffset);
+  msTranslatef(0.0, -4.0, 0.0);
+  GLfloat root[16];
+  memcpy(root,msTop(),sizeof(root));
+  msPushMatrix(); /* (cursor, Sol) */
+  msLoadIdentity(); /* record the cursor relative to root */
+  batchReset();
+
+  /* Draw cursor */
+  msTranslatef(0.0, 4.0, 0.0);
+  batchBegin(GL_TRIANGLES,pink);
+  int xCursor = frame->xCursor;
+  int yCursor = frame->yCursor;
+  drawboldline2(xCursor - 0.5, yCursor - 0.5,xCursor + 0.5, yCursor + 0.5);
+  drawboldline2(xCursor - 0.5, yCursor + 0.5,xCursor + 0.5, yCursor - 0.5);
+  drawboldline2(0.0,0.0,xCursor,yCursor);
+  /* end cursor */
+  batchUpload();
+  batchCull(root);
+  // Draw Sol
+  // obtain first rotation matrix
+  GLfloat theta1[16];
+  mat4Identity(theta1);
+  mat4Rotate(theta1,fmod(60.0 + frame->sunAngle3/64.0,360.0),1.0,0.0,0.0);
+  // obtain second rotation matrix
+  GLfloat theta2[16];
+  mat4Identity(theta2);
+  mat4Rotate(theta2,fmod(45.0 + frame->sunAngle3/27.0,360.0),0.0,0.0,1.0);
+  GLfloat solFrame[16];
+  memcpy(solFrame,root,sizeof(solFrame));
+  mat4Translate(solFrame,0.0,4.0,0.0);
+  gatherSols(solFrame,theta1,theta2);
+  msPopMatrix(); /* end (cursor, Sol) */
+  msPopMatrix(); /* end scene */
+  statsPhase(PHASE_DRAW2);
+  if (useCore) {
+      coreDrawScene(root);
+      statsPhase(PHASE_MIRROR);
+      return;
+  }
+  int v;
+  for (v = 0; v < VARIANTS; v += 1) {
+      if (mirrorMask & (1 << v)) {
+          variantLight(v);
+          drawBatch(root,v);
       }
-    }
   }
-  glPopMatrix(); /* end (green grid, cursor, marquee, Sol) */
-  glPopMatrix(); /* end scene */
+  drawSols();
+  STATS_CALL(glLoadIdentity());
+  statsPhase(PHASE_MIRROR);
 }
 
 static double maxFastMove = 0.01;
 static double maxVenusMove = 0.01;
 static double maxWarmMove = 0.01;
-static GLfloat lightpos[4] = {0.0,0.0,0.0,0.0};
-/* update animation parameters */
-static void animate(void) {
-  double rawMatAlpha = fmod(gearsGetTime(2),2.0 * M_PI);
-  matAlpha = ( 1.0 + sin(rawMatAlpha) ) / 2.0;
+
+/* jump the timeline to time t */
+static void tlSeek(double t) {
+  tlTime = t;
+  if (!tlFixed) {
+      timeOffset = t - glfwGetTime();
+  }
+}
+
+/* step the timeline one frame and take its snapshot */
+static void tlAdvance(void) {
+  gearsFrame * f = & snapshot;
+  int c;
+  if (tlFixed) {
+      f->time = tlTime;
+      tlTime += tlDt;
+  } else {
+      f->time = timeOffset + glfwGetTime();
+  }
+  for (c = 0; c < 5; c += 1) {
+      f->channel[c] = gearsChannel(f->time,c);
+  }
+  double rawMatAlpha = fmod(f->channel[2],2.0 * M_PI);
+  f->matAlpha = ( 1.0 + sin(rawMatAlpha) ) / 2.0;
   // calculate FAST2
   double fastMoveAbs = fabs(FAST - FAST2);
   if ( fastMoveAbs <= maxFastMove ) {
@@ -775,37 +2599,33 @@ static void animate(void) {
     double warmMoveDelta = WARM2 < WARM ? warmMoveAbs : -warmMoveAbs;
     WARM2 = WARM2 + warmMoveDelta;
   }
+  f->FAST2 = FAST2;
+  f->VENUS2 = VENUS2;
+  f->WARM2 = WARM2;
+  // Calculate the number of cones
+  int CONES = ((float) CONE_MIN) + ((float) CONE_DELTA) * WARM2;
+  CONES = CONES <= 0 ? 0 : CONES;
+  CONES = CONES >= (CONE_MIN + CONE_DELTA) ? (CONE_MIN + CONE_DELTA) : CONES;
+  f->cones = CONES;
+  f->solscale = 2.0 * fabs(FAST2 - 0.5);
   int sceneRotate = 1;
   if (sceneRotate) {
-      sceneAngle = 90 + 20.0 * gearsGetTime(2);
+      f->sceneAngle = 90 + 20.0 * f->channel[2];
   } else {
-      sceneAngle = -45;
+      f->sceneAngle = -45;
   }
   double lightAngle,lightHeight;
-  lightAngle = 0.48 * gearsGetTime(1);
+  lightAngle = 0.48 * f->channel[1];
   lightHeight = 600.0 + 400.0 * sin(fmod(lightAngle,2.0 * M_PI));
   lightAngle = 1.5 + 57.0 * lightAngle;
-  GLfloat pos[4] = {0.0,0.0,0.0,0.0};
-  pos[0] = 200.0 * cos(fmod(lightAngle,2.0 * M_PI));
-  pos[1] = 200.0 * sin(fmod(lightAngle,2.0 * M_PI));
-  pos[2] = lightHeight;
-  lightpos[0] = pos[0];
-  lightpos[1] = pos[1];
-  lightpos[2] = pos[2];
-  glLightfv(GL_LIGHT0, GL_POSITION, pos);
-  pos[0] *= -1.0;
-  pos[1] *= -1.0;
-  glLightfv(GL_LIGHT1, GL_POSITION, pos);
-  GLfloat temp;
-  temp = pos[0];
-  pos[0] = -pos[1];
-  pos[1] = temp;
-  glLightfv(GL_LIGHT2, GL_POSITION, pos);
-  pos[0] *= -1.0;
-  pos[1] *= -1.0;
-  glLightfv(GL_LIGHT3, GL_POSITION, pos);
-  sunAngle2 = 15.0 * gearsGetTime(0);
-  sunAngle3 = 1350.0 * gearsGetTime(2);
+  f->lightpos[0] = 200.0 * cos(fmod(lightAngle,2.0 * M_PI));
+  f->lightpos[1] = 200.0 * sin(fmod(lightAngle,2.0 * M_PI));
+  f->lightpos[2] = lightHeight;
+  f->lightpos[3] = 0.0;
+  f->sunAngle2 = 15.0 * f->channel[0];
+  f->sunAngle3 = 1350.0 * f->channel[2];
+  f->waveInner = sin(fmod(f->channel[4],2.0 * M_PI));
+  f->waveOuter = 0.25 * cos(fmod(f->channel[4],2.0 * M_PI));
   animIndex += 1;
   if (0 == animIndex % animPeriod) {
       xCursor += 1;
@@ -817,6 +2637,88 @@ static void animate(void) {
           yCursor = (yCursor > 10 ? -(HUDHEIGHT / 2) : yCursor);
       }
   }
+  f->xCursor = xCursor;
+  f->yCursor = yCursor;
+  f->index += 1;
+}
+
+/* update animation parameters */
+static void animate(void) {
+  tlAdvance();
+  if (useCore) {
+      return; /* coreDrawScene() reads frame->lightpos */
+  }
+  GLfloat pos[4];
+  memcpy(pos,frame->lightpos,sizeof(pos));
+  STATS_CALL(glLightfv(GL_LIGHT0, GL_POSITION, pos));
+  pos[0] *= -1.0;
+  pos[1] *= -1.0;
+  STATS_CALL(glLightfv(GL_LIGHT1, GL_POSITION, pos));
+  GLfloat temp;
+  temp = pos[0];
+  pos[0] = -pos[1];
+  pos[1] = temp;
+  STATS_CALL(glLightfv(GL_LIGHT2, GL_POSITION, pos));
+  pos[0] *= -1.0;
+  pos[1] *= -1.0;
+  STATS_CALL(glLightfv(GL_LIGHT3, GL_POSITION, pos));
+}
+
+/* Frame pacing.  Instead of a fixed sleep before every frame, paceWait()
+   sleeps only the slack left between the last swap plus one target
+   period and the predicted cost of the coming frame, so animate() runs
+   as late as possible while still making the next vsync.  The cost is
+   measured from the end of the sleep to the swap call and rises at once
+   but decays slowly.  With -uncapped there is no sleep and no vsync. */
+#define PACE_MARGIN 0.002 /* seconds kept in hand before the vsync */
+#define PACE_LOG_DELTA 0.1 /* relative frame-time change worth a log line */
+static double paceRate = 60.0; /* target frames per second, -hz */
+static int paceUncapped = 0;
+static double paceCost = 0.0; /* predicted render cost */
+static double paceStart = 0.0; /* end of the last sleep */
+static double paceRendered = 0.0; /* render cost of the last frame */
+static double paceSlept = 0.0;
+static double paceSwap = -1.0; /* when the last swap returned */
+static double paceLogged = 0.0; /* frame time of the last log line */
+static long paceFrame = 0;
+
+static void paceWait(void) {
+  double now = glfwGetTime();
+  paceSlept = 0.0;
+  if (!paceUncapped && paceSwap >= 0.0) {
+      double wake = paceSwap + 1.0 / paceRate - paceCost - PACE_MARGIN;
+      if (wake > now) {
+          usleep((useconds_t) ((wake - now) * 1.0e6));
+          paceSlept = wake - now;
+      }
+  }
+  paceStart = glfwGetTime();
+}
+
+/* call just before swapping */
+static void paceSubmit(void) {
+  paceRendered = glfwGetTime() - paceStart;
+  if (paceRendered > paceCost) {
+      paceCost = paceRendered;
+  } else {
+      paceCost = 0.95 * paceCost + 0.05 * paceRendered;
+  }
+}
+
+/* call just after swapping */
+static void paceSwapped(void) {
+  double now = glfwGetTime();
+  if (paceSwap >= 0.0) {
+      double frameTime = now - paceSwap;
+      if (fabs(frameTime - paceLogged) > PACE_LOG_DELTA * paceLogged) {
+          printf("[pace] frame %ld: %.2f ms (render %.2f ms, slept %.2f ms)\n",
+              paceFrame,1000.0 * frameTime,1000.0 * paceRendered,1000.0 * paceSlept);
+          fflush(stdout);
+          paceLogged = frameTime;
+      }
+  }
+  paceSwap = now;
+  paceFrame += 1;
 }
 
 static int sizeChange = 0;
@@ -839,6 +2741,27 @@ void key(GLFWwindow * window,int k,int s,int action,int mods) {
           VENUS = 1;
       }
       break;
+    case GLFW_KEY_M:
+      if ( mirrorMask == 0xf ) {
+          mirrorMask = 0x3;
+      } else {
+          mirrorMask = 0xf;
+      }
+      break;
+    case GLFW_KEY_P:
+      statsOverlay = !statsOverlay;
+      break;
+    case GLFW_KEY_C:
+      statsToggleCsv();
+      break;
+    case GLFW_KEY_LEFT_BRACKET:
+      lodThreshold *= 0.5;
+      printf("[lod] threshold %g pixels\n",lodThreshold);
+      break;
+    case GLFW_KEY_RIGHT_BRACKET:
+      lodThreshold *= 2.0;
+      printf("[lod] threshold %g pixels\n",lodThreshold);
+      break;
     case GLFW_KEY_T:
       if ( FAST ) {
           FAST = 0;
@@ -919,6 +2842,138 @@ void cursor(GLFWwindow * window, double x, double y) {
     y *= -1 * 20 * (windowHeight / windowWidth);
     cursor2y = y;
 }
+/* Dynamic resolution.  With -dynres the frame is drawn into an
+   offscreen framebuffer at a fraction of the window's size, between
+   dynresMin and dynresMax of each side, and blitted up to the window.
+   The fraction follows the render cost: GPU time from timer queries read
+   back DYNRES_QUERIES frames later, so they never stall, or the CPU time
+   from dynresBegin() to dynresEnd() without them.  Fill cost goes with
+   area, so each sample is divided by the square of the fraction it was
+   drawn at, and the fraction becomes the square root of the budget,
+   DYNRES_TARGET of the pacing period, over that full-size cost. */
+#define DYNRES_QUERIES 4
+#define DYNRES_TARGET 0.8
+#define DYNRES_STEP 0.05 /* smallest relative change worth applying */
+static int dynres = 0;
+static double dynresMin = 0.5; /* -dynres min max */
+static double dynresMax = 1.0;
+static double dynresScale = 1.0;
+static double dynresCost = 0.0; /* at full size; rises at once, decays slowly */
+static double dynresStart;
+static GLuint dynresFbo = 0;
+static GLuint dynresColor;
+static GLuint dynresDepth;
+static int dynresWidth; /* window framebuffer */
+static int dynresHeight;
+static GLuint dynresQuery[DYNRES_QUERIES];
+static double dynresQueryScale[DYNRES_QUERIES]; /* the fraction each was drawn at */
+static int dynresTimer = 0; /* timer queries available */
+static long dynresFrame = 0;
+
+/* size the offscreen buffers for a width x height window */
+static void dynresResize(int width, int height) {
+  dynresWidth = width;
+  dynresHeight = height;
+  if (!dynres) {
+      return;
+  }
+  if (dynresFbo == 0) {
+      if (!GLAD_GL_VERSION_3_0) {
+          printf("OpenGL 3.0 not available; no dynamic resolution\n");
+          dynres = 0;
+          return;
+      }
+      glGenFramebuffers(1,& dynresFbo);
+      glGenRenderbuffers(1,& dynresColor);
+      glGenRenderbuffers(1,& dynresDepth);
+      dynresTimer = GLAD_GL_VERSION_3_3;
+      if (dynresTimer) {
+          glGenQueries(DYNRES_QUERIES,dynresQuery);
+      }
+  }
+  int w = (int) ceil(width * dynresMax);
+  int h = (int) ceil(height * dynresMax);
+  glBindRenderbuffer(GL_RENDERBUFFER,dynresColor);
+  glRenderbufferStorage(GL_RENDERBUFFER,GL_RGBA8,w,h);
+  glBindRenderbuffer(GL_RENDERBUFFER,dynresDepth);
+  glRenderbufferStorage(GL_RENDERBUFFER,GL_DEPTH_COMPONENT24,w,h);
+  glBindRenderbuffer(GL_RENDERBUFFER,0);
+  glBindFramebuffer(GL_FRAMEBUFFER,dynresFbo);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER,GL_COLOR_ATTACHMENT0,GL_RENDERBUFFER,dynresColor);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER,GL_DEPTH_ATTACHMENT,GL_RENDERBUFFER,dynresDepth);
+  if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+      printf("offscreen framebuffer incomplete; no dynamic resolution\n");
+      dynres = 0;
+  }
+  glBindFramebuffer(GL_FRAMEBUFFER,0);
+}
+
+/* fold a sample of the render cost at fraction scale into dynresCost */
+static void dynresSample(double cost, double scale) {
+  cost /= scale * scale;
+  dynresCost = cost > dynresCost ? cost : 0.9 * dynresCost + 0.1 * cost;
+}
+
+static int dynresSide(int side) {
+  int n = (int) (side * dynresScale + 0.5);
+  return n < 1 ? 1 : n;
+}
+
+/* redirect the frame into the offscreen buffer */
+static void dynresBegin(void) {
+  GLuint64 elapsed;
+  GLint ready = 0;
+  if (!dynres) {
+      return;
+  }
+  dynresStart = glfwGetTime();
+  if (dynresTimer) {
+      int k = dynresFrame % DYNRES_QUERIES;
+      if (dynresFrame >= DYNRES_QUERIES) {
+          STATS_CALL(glGetQueryObjectiv(dynresQuery[k],GL_QUERY_RESULT_AVAILABLE,& ready));
+          if (ready) {
+              STATS_CALL(glGetQueryObjectui64v(dynresQuery[k],GL_QUERY_RESULT,& elapsed));
+              dynresSample(1.0e-9 * elapsed,dynresQueryScale[k]);
+          }
+      }
+      dynresQueryScale[k] = dynresScale;
+      STATS_CALL(glBeginQuery(GL_TIME_ELAPSED,dynresQuery[k]));
+  }
+  STATS_CALL(glBindFramebuffer(GL_FRAMEBUFFER,dynresFbo));
+  STATS_CALL(glViewport(0,0,dynresSide(dynresWidth),dynresSide(dynresHeight)));
+  lodPixels = 0.5 * dynresSide(dynresWidth) * projection[0];
+}
+
+/* scale the frame up to the window and pick the next frame's size */
+static void dynresEnd(void) {
+  if (!dynres) {
+      return;
+  }
+  STATS_CALL(glBindFramebuffer(GL_READ_FRAMEBUFFER,dynresFbo));
+  STATS_CALL(glBindFramebuffer(GL_DRAW_FRAMEBUFFER,0));
+  STATS_CALL(glBlitFramebuffer(0,0,dynresSide(dynresWidth),dynresSide(dynresHeight),
+      0,0,dynresWidth,dynresHeight,GL_COLOR_BUFFER_BIT,GL_LINEAR));
+  STATS_CALL(glBindFramebuffer(GL_FRAMEBUFFER,0));
+  STATS_CALL(glViewport(0,0,dynresWidth,dynresHeight));
+  if (dynresTimer) {
+      STATS_CALL(glEndQuery(GL_TIME_ELAPSED));
+  } else {
+      dynresSample(glfwGetTime() - dynresStart,dynresScale);
+  }
+  dynresFrame += 1;
+  if (dynresCost <= 0.0) {
+      return;
+  }
+  double scale = sqrt(DYNRES_TARGET / paceRate / dynresCost);
+  scale = scale < dynresMin ? dynresMin : scale > dynresMax ? dynresMax : scale;
+  if (fabs(scale - dynresScale) > DYNRES_STEP * dynresScale) {
+      dynresScale = scale;
+      printf("[dynres] frame %ld: %dx%d (%.0f%%)\n",dynresFrame,
+          dynresSide(dynresWidth),dynresSide(dynresHeight),100.0 * dynresScale);
+      fflush(stdout);
+  }
+}
+
 /* new window size */
 void reshape( GLFWwindow * window, int width, int height ) {
   //printf("reshape: %f %f\n",(double) width,(double) height);
@@ -930,6 +2985,14 @@ void reshape( GLFWwindow * window, int width, int height ) {
   zfar  = 60.0f;
   xmax  = znear * 0.5f;
   glViewport( 0, 0, (GLint) width, (GLint) height );
+  mat4Identity(projection);
+  mat4Frustum(projection, -xmax, xmax, -xmax*h, xmax*h, znear, zfar );
+  lodPixels = 0.5 * width * projection[0];
+  frustumPlanes(projection);
+  dynresResize(width,height);
+  if (useCore) {
+      return;
+  }
   glMatrixMode( GL_PROJECTION );
   glLoadIdentity();
   glFrustum( -xmax, xmax, -xmax*h, xmax*h, znear, zfar );
@@ -1011,6 +3074,20 @@ static void init(void) {
   ldPalette(pa3,cerulean);
   ldPalette3i(pa3,46,139,87); /* sea green */
   cursor2x = cursor2y = 0;
+  glEnable(GL_CULL_FACE);
+  glEnable(GL_DEPTH_TEST);
+  glEnable(GL_LINE_SMOOTH);
+  initCones();
+  initSols();
+  solPoolBegin();
+  bakeScene();
+  if (useCore) {
+      if (!initCore()) {
+          fprintf(stderr,"cannot build the core-profile renderer\n");
+          exit( EXIT_FAILURE );
+      }
+      return;
+  }
   glShadeModel(GL_SMOOTH);
   glLightfv(GL_LIGHT0, GL_POSITION, pos);
   glLightfv(GL_LIGHT0, GL_DIFFUSE, intensity);
@@ -1028,10 +3105,7 @@ static void init(void) {
   glLightfv(GL_LIGHT3, GL_DIFFUSE, intensity);
   glLightfv(GL_LIGHT3, GL_SPECULAR, intensity);
   //glLightfv(GL_LIGHT3, GL_AMBIENT, intensity0);
-  glEnable(GL_CULL_FACE);
-  glEnable(GL_DEPTH_TEST);
   glEnable(GL_NORMALIZE);
-  glEnable(GL_LINE_SMOOTH);
   //glEnable(GL_BLEND);
   //glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 }
@@ -1102,180 +3176,649 @@ void readDefault(void) {
     fflush(stdout);
 }
 
-void writeDefault(void) {
-    FILE * f = fopen(DEFAULT_FILENAME,"w");
-    // write fast state
-    if ( FAST ) {
-        fprintf(f,"f");
-        printf ("set fast\n");
-    } else {
-        fprintf(f,"!f");
-        printf("set nofast\n");
+#ifndef GEARS_BENCH
+/* read one number from a legacy per-value file, if it exists */
+static int readLegacy(const char * path, double * value) {
+    FILE * f = fopen(path,"r");
+    int ok;
+    if (f == NULL) {
+        return 0;
     }
-    // write venus state
-    if ( VENUS ) {
-        fprintf(f,"v");
-        printf("set venus\n");
-    } else {
-        fprintf(f,"!v");
-        printf("set novenus\n");
+    ok = fscanf(f,"%lf",value) == 1;
+    fclose(f);
+    return ok;
+}
+
+/* Config store.  All persistent state lives in one "key = value" file.
+   It is read through mmap, written to a temporary file that is renamed
+   over it so readers never see half a file, and watched (inotify on
+   Linux, its modification time elsewhere) so edits made while gears runs
+   are applied at the next frame boundary.  On the first run the seven
+   legacy files are imported. */
+#define CONFIG_FILENAME "/Users/dbp/gears/gears.conf"
+#define CONFIG_DIRECTORY "/Users/dbp/gears"
+#define CONFIG_BASENAME "gears.conf"
+
+typedef struct gearsConfig {
+    int fast;
+    int venus;
+    int warm;
+    int resolution;
+    double offset;
+    double rotx;
+    double roty;
+    double camHeight;
+    double floorOffset;
+    double range;
+} gearsConfig;
+
+static gearsConfig config; /* as last read or written */
+static int configFd = -1; /* inotify descriptor */
+static time_t configMtime = 0;
+
+/* the state the config describes, taken from the running program */
+static void configCapture(gearsConfig * c) {
+    c->fast = FAST;
+    c->venus = VENUS;
+    c->warm = WARM;
+    c->resolution = resNum;
+    c->offset = frame->time;
+    c->rotx = fmod(view_rotx,360.0);
+    c->roty = fmod(view_roty,360.0);
+    c->camHeight = camHeight;
+    c->floorOffset = floorOffset;
+    c->range = range;
+}
+
+/* parse "key = value" lines; unknown keys and '#' comments are skipped */
+static void configParse(const char * text, size_t length, gearsConfig * c) {
+    const char * end = text + length;
+    while (text < end) {
+        const char * eol = memchr(text,'\n',end - text);
+        char line[256];
+        char key[64];
+        double value;
+        size_t n;
+        if (! eol) {
+            eol = end;
+        }
+        n = eol - text < (long) sizeof(line) - 1 ? (size_t) (eol - text) : sizeof(line) - 1;
+        memcpy(line,text,n);
+        line[n] = 0;
+        text = eol + 1;
+        if (line[0] == '#' || sscanf(line," %63[a-z] = %lf",key,& value) != 2) {
+            continue;
+        }
+        if (0 == strcmp(key,"fast")) {
+            c->fast = value != 0.0;
+        } else if (0 == strcmp(key,"venus")) {
+            c->venus = value != 0.0;
+        } else if (0 == strcmp(key,"warm")) {
+            c->warm = value != 0.0;
+        } else if (0 == strcmp(key,"resolution")) {
+            c->resolution = (int) value;
+        } else if (0 == strcmp(key,"offset")) {
+            c->offset = value;
+        } else if (0 == strcmp(key,"rotx")) {
+            c->rotx = value;
+        } else if (0 == strcmp(key,"roty")) {
+            c->roty = value;
+        } else if (0 == strcmp(key,"camheight")) {
+            c->camHeight = value;
+        } else if (0 == strcmp(key,"flooroffset")) {
+            c->floorOffset = value;
+        } else if (0 == strcmp(key,"range")) {
+            c->range = value;
+        }
     }
-    // write warm state
-    if ( WARM ) {
-        fprintf(f,"w");
-        printf("set warm\n");
-    } else {
-        fprintf(f,"!w");
-        printf("set nowarm\n");
+}
+
+/* read the config over c; returns 0 if there is no config file */
+static int configRead(gearsConfig * c) {
+    struct stat st;
+    int fd = open(CONFIG_FILENAME,O_RDONLY);
+    if (fd < 0) {
+        return 0;
     }
-    // write resolution number
-    int savedResNum = resNum;
-    int i;
-    while (resNum >= 5) {
-        fprintf(f,"x");
-        resNum -= 5;
-    }
-    for (i = 0;i < resNum;i += 1) {
-        fprintf(f,"+");
-    }
-    resNum = savedResNum;
-    fprintf(f,"r");
-    printf("set resolution=%d [%dx%d] \n",resNum,
-        resWidth[resNum],resHeight[resNum]);
-    fprintf(f,"\n");
-    fflush(f);
-    fclose(f);
-    fflush(stdout);
+    if (fstat(fd,& st) == 0 && st.st_size > 0) {
+        void * text = mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+        if (text != MAP_FAILED) {
+            configParse(text,st.st_size,c);
+            munmap(text,st.st_size);
+        }
+        configMtime = st.st_mtime;
+    }
+    close(fd);
+    return 1;
 }
 
-void readTimeOffset(void) {
-    FILE * f = fopen(OFFSET_FILENAME,"r");
-    double g;
-    fscanf(f,"%lf",& g);
-    timeOffset = g;
-    fclose(f);
-    printf("read timeOffset = %f from '%s'\n",g,OFFSET_FILENAME);
+/* write c to a temporary file and rename it over the config; on any
+   write error the old config is left alone and 0 is returned */
+static int configWrite(const gearsConfig * c) {
+    char temp[] = CONFIG_FILENAME ".tmp";
+    FILE * f = fopen(temp,"w");
+    if (f == NULL) {
+        fprintf(stderr,"cannot write '%s'\n",temp);
+        return 0;
+    }
+    fprintf(f,"# gears state, rewritten at exit; edits apply while running\n");
+    fprintf(f,"fast = %d\nvenus = %d\nwarm = %d\n",c->fast,c->venus,c->warm);
+    fprintf(f,"resolution = %d\n",c->resolution);
+    fprintf(f,"offset = %f\n",c->offset);
+    fprintf(f,"rotx = %f\nroty = %f\n",c->rotx,c->roty);
+    fprintf(f,"camheight = %f\nflooroffset = %f\nrange = %f\n",
+        c->camHeight,c->floorOffset,c->range);
+    int failed = fflush(f) != 0 || ferror(f) || fsync(fileno(f)) != 0;
+    if (fclose(f) != 0 || failed) {
+        /* a short temporary file must never replace a good config */
+        fprintf(stderr,"cannot write '%s'\n",temp);
+        unlink(temp);
+        return 0;
+    }
+    if (rename(temp,CONFIG_FILENAME) != 0) {
+        fprintf(stderr,"cannot replace '%s'\n",CONFIG_FILENAME);
+        unlink(temp);
+        return 0;
+    }
+    int dir = open(CONFIG_DIRECTORY,O_RDONLY);
+    if (dir >= 0) {
+        fsync(dir); /* make the rename itself durable */
+        close(dir);
+    }
+    printf("wrote config to '%s'\n",CONFIG_FILENAME);
     fflush(stdout);
+    return 1;
 }
 
-void readRotx(void) {
-    FILE * f = fopen(ROTX_FILENAME,"r");
-    double g;
-    fscanf(f,"%lf",& g);
-    view_rotx = g;
-    fclose(f);
-    printf("read view_rotx = %f from '%s'\n",g,ROTX_FILENAME);
-    fflush(stdout);
+/* make c the running state; old is the state it replaces, or NULL at
+   startup.  Only the fields that differ from old are applied, so state
+   changed from the keyboard survives edits to other keys.  Returns 1 if
+   the resolution changed. */
+static int configApply(const gearsConfig * c, const gearsConfig * old) {
+    if (! old || c->fast != old->fast) {
+        FAST = c->fast;
+    }
+    if (! old || c->venus != old->venus) {
+        VENUS = c->venus;
+    }
+    if (! old || c->warm != old->warm) {
+        WARM = c->warm;
+    }
+    if (! old || c->rotx != old->rotx) {
+        view_rotx = c->rotx;
+    }
+    if (! old || c->roty != old->roty) {
+        view_roty = c->roty;
+    }
+    if (! old || c->camHeight != old->camHeight) {
+        camHeight = c->camHeight;
+    }
+    if (! old || c->floorOffset != old->floorOffset) {
+        floorOffset = c->floorOffset;
+    }
+    if (! old || c->range != old->range) {
+        range = c->range;
+    }
+    if (! old) {
+        timeOffset = c->offset;
+    } else if (c->offset != old->offset) {
+        tlSeek(c->offset);
+    }
+    if (! old || c->resolution != old->resolution) {
+        setResolution(c->resolution);
+        return 1;
+    }
+    return 0;
 }
 
-void readRoty(void) {
-    FILE * f = fopen(ROTY_FILENAME,"r");
-    double g;
-    fscanf(f,"%lf",& g);
-    view_roty = g;
-    fclose(f);
-    printf("read view_roty = %f from '%s'\n",g,ROTY_FILENAME);
+/* load the config, importing the legacy files if there is none yet */
+static void configLoad(void) {
+    gearsConfig c;
+    configCapture(& c);
+    c.offset = timeOffset;
+    if (configRead(& c)) {
+        configApply(& c,NULL);
+        printf("read config from '%s'\n",CONFIG_FILENAME);
+    } else {
+        readDefault();
+        readLegacy(OFFSET_FILENAME,& timeOffset);
+        readLegacy(ROTX_FILENAME,& view_rotx);
+        readLegacy(ROTY_FILENAME,& view_roty);
+        readLegacy(CAMHEIGHT_FILENAME,& camHeight);
+        readLegacy(FLOOROFFSET_FILENAME,& floorOffset);
+        readLegacy(RANGE_FILENAME,& range);
+        printf("no '%s'; imported the legacy settings\n",CONFIG_FILENAME);
+    }
+    configCapture(& config);
+    config.offset = timeOffset;
     fflush(stdout);
 }
 
-void readCamHeight(void) {
-    FILE * f = fopen(CAMHEIGHT_FILENAME,"r");
-    double g;
-    fscanf(f,"%lf",& g);
-    camHeight = g;
-    fclose(f);
-    printf("read camHeight = %f from '%s'\n",g,CAMHEIGHT_FILENAME);
-    fflush(stdout);
+static void configWatch(void) {
+#ifdef __linux__
+    /* watch the directory: a rename replaces the file's inode */
+    configFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (configFd >= 0 &&
+            inotify_add_watch(configFd,CONFIG_DIRECTORY,IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        close(configFd);
+        configFd = -1;
+    }
+#endif
 }
 
-void readFloorOffset(void) {
-    FILE * f = fopen(FLOOROFFSET_FILENAME,"r");
-    double g;
-    fscanf(f,"%lf",& g);
-    floorOffset = g;
-    fclose(f);
-    printf("read floorOffset = %f from '%s'\n",g,FLOOROFFSET_FILENAME);
-    fflush(stdout);
+/* has the config file changed since it was last read? */
+static int configChanged(void) {
+#ifdef __linux__
+    if (configFd >= 0) {
+        char events[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+        int changed = 0;
+        ssize_t n;
+        while ((n = read(configFd,events,sizeof(events))) > 0) {
+            char * e = events;
+            while (e < events + n) {
+                const struct inotify_event * ev = (const struct inotify_event *) e;
+                if (ev->len > 0 && 0 == strcmp(ev->name,CONFIG_BASENAME)) {
+                    changed = 1;
+                }
+                e += sizeof(struct inotify_event) + ev->len;
+            }
+        }
+        return changed;
+    }
+#endif
+    static int poll = 0;
+    struct stat st;
+    poll = (poll + 1) % 60;
+    if (poll != 0 || stat(CONFIG_FILENAME,& st) != 0) {
+        return 0;
+    }
+    return st.st_mtime != configMtime;
 }
 
-void readRange(void) {
-    FILE * f = fopen(RANGE_FILENAME,"r");
-    double g;
-    fscanf(f,"%lf",& g);
-    range = g;
-    fclose(f);
-    printf("read range = %f from '%s'\n",g,RANGE_FILENAME);
+/* apply edits to the config; call between frames.  Returns 1 if the
+   window has to be resized. */
+static int configReload(void) {
+    gearsConfig c = config;
+    if (! configRead(& c) || 0 == memcmp(& c,& config,sizeof(c))) {
+        return 0;
+    }
+    printf("config changed; applying '%s'\n",CONFIG_FILENAME);
     fflush(stdout);
+    int resized = configApply(& c,& config);
+    config = c;
+    return resized;
 }
 
-void writeTimeOffset(void) {
-    FILE * f = fopen(OFFSET_FILENAME,"w");
-    double haltTime = timeOffset + glfwGetTime();
-    fprintf(f,"%f\n",haltTime);
-    fflush(f);
-    fclose(f);
-    printf("wrote haltTime = %f to '%s'\n",haltTime,OFFSET_FILENAME);
-    fflush(stdout);
+/* save the running state */
+static void configSave(void) {
+    configCapture(& config);
+    configWrite(& config);
 }
+#endif
 
-void writeRotx(void) {
-    FILE * f = fopen(ROTX_FILENAME,"w");
-    view_rotx = fmod(view_rotx,360.0);
-    fprintf(f,"%f\n",view_rotx);
-    fflush(f);
-    fclose(f);
-    printf("wrote view_rotx = %f to '%s'\n",view_rotx,ROTX_FILENAME);
-    fflush(stdout);
+/* Offline export.  With -export the window stays hidden and frames
+   first..last of the fixed-step timeline are rendered as fast as the GL
+   allows.  Each frame is read back into one of EXPORT_RING pixel pack
+   buffers; a buffer is only mapped again EXPORT_RING frames later, by
+   which time its transfer has long finished, so glReadPixels never waits
+   on the render loop.  Mapped pixels are copied into a job and handed to
+   a pool of encoder threads that write raw RGBA, PPM or PNG files. */
+#define EXPORT_RING 4
+#define EXPORT_MAX_WORKERS 32
+#define EXPORT_RAW 0
+#define EXPORT_PPM 1
+#define EXPORT_PNG 2
+
+typedef struct exportJob {
+    long frame;
+    unsigned char * pixels; /* RGBA, bottom row first */
+    struct exportJob * next;
+} exportJob;
+
+static int exporting = 0;
+static long exportFirst = 0;
+static long exportLast = 0;
+static const char * exportPattern = "gears%05ld.png";
+static int exportLong = 1; /* the pattern's conversion takes a long */
+static int exportFormat = EXPORT_PNG;
+static int exportWorkers = 0; /* 0: one per core */
+static int exportWidth;
+static int exportHeight;
+static GLuint exportPbo[EXPORT_RING];
+static long exportPboFrame[EXPORT_RING];
+static thrd_t exportThreads[EXPORT_MAX_WORKERS];
+static mtx_t exportLock;
+static cnd_t exportReady; /* a job was queued or the export finished */
+static cnd_t exportRoom; /* a job was taken off the queue */
+static exportJob * exportHead = NULL;
+static exportJob * exportTail = NULL;
+static int exportQueued = 0;
+static int exportDone = 0;
+
+/* check that p is a printf pattern with exactly one integer conversion
+   (%d, %05ld, ...) and no other; sets exportLong */
+static int exportCheckPattern(const char * p) {
+  int conversions = 0;
+  for (; *p; p += 1) {
+      if (*p != '%') {
+          continue;
+      }
+      p += 1;
+      if (*p == '%') {
+          continue;
+      }
+      p += strspn(p,"-+ #0");
+      p += strspn(p,"0123456789");
+      if (*p == '.') {
+          p += 1;
+          p += strspn(p,"0123456789");
+      }
+      exportLong = *p == 'l';
+      p += exportLong;
+      if (! *p || ! strchr("diouxX",*p)) {
+          return 0;
+      }
+      conversions += 1;
+  }
+  return conversions == 1;
 }
 
-void writeRoty(void) {
-    FILE * f = fopen(ROTY_FILENAME,"w");
-    view_roty = fmod(view_roty,360.0);
-    fprintf(f,"%f\n",view_roty);
-    fflush(f);
-    fclose(f);
-    printf("wrote view_roty = %f to '%s'\n",view_roty,ROTY_FILENAME);
-    fflush(stdout);
+static void exportEncode(const exportJob * job) {
+  char name[1024];
+  size_t row = (size_t) exportWidth * 4;
+  int y,x;
+  if (exportLong) {
+      snprintf(name,sizeof(name),exportPattern,job->frame);
+  } else {
+      snprintf(name,sizeof(name),exportPattern,(int) job->frame);
+  }
+  if (exportFormat == EXPORT_PNG) {
+      // Write image Y-flipped because OpenGL
+      stbi_write_png(name,exportWidth,exportHeight,4,
+          job->pixels + row * (exportHeight - 1),-(int) row);
+      return;
+  }
+  FILE * f = fopen(name,"wb");
+  if (! f) {
+      fprintf(stderr,"export: cannot write '%s'\n",name);
+      return;
+  }
+  if (exportFormat == EXPORT_PPM) {
+      unsigned char * rgb = malloc((size_t) exportWidth * 3);
+      fprintf(f,"P6\n%d %d\n255\n",exportWidth,exportHeight);
+      for (y = exportHeight - 1;y >= 0;y -= 1) {
+          const unsigned char * src = job->pixels + row * y;
+          for (x = 0;x < exportWidth;x += 1) {
+              rgb[3 * x + 0] = src[4 * x + 0];
+              rgb[3 * x + 1] = src[4 * x + 1];
+              rgb[3 * x + 2] = src[4 * x + 2];
+          }
+          fwrite(rgb,3,exportWidth,f);
+      }
+      free(rgb);
+  } else {
+      for (y = exportHeight - 1;y >= 0;y -= 1) {
+          fwrite(job->pixels + row * y,1,row,f);
+      }
+  }
+  fclose(f);
 }
 
-void writeCamHeight(void) {
-    FILE * f = fopen(CAMHEIGHT_FILENAME,"w");
-    fprintf(f,"%f\n",camHeight);
-    fflush(f);
-    fclose(f);
-    printf("wrote camHeight = %f to '%s'\n",camHeight,CAMHEIGHT_FILENAME);
-    fflush(stdout);
+static int exportWorker(void * arg) {
+  for (;;) {
+      mtx_lock(& exportLock);
+      while (! exportHead && ! exportDone) {
+          cnd_wait(& exportReady,& exportLock);
+      }
+      exportJob * job = exportHead;
+      if (! job) {
+          mtx_unlock(& exportLock);
+          return 0;
+      }
+      exportHead = job->next;
+      if (! exportHead) exportTail = NULL;
+      exportQueued -= 1;
+      cnd_signal(& exportRoom);
+      mtx_unlock(& exportLock);
+      exportEncode(job);
+      free(job->pixels);
+      free(job);
+  }
 }
 
-void writeFloorOffset(void) {
-    FILE * f = fopen(FLOOROFFSET_FILENAME,"w");
-    fprintf(f,"%f\n",floorOffset);
-    fflush(f);
-    fclose(f);
-    printf("wrote floorOffset = %f to '%s'\n",floorOffset,FLOOROFFSET_FILENAME);
-    fflush(stdout);
+/* queue a frame for the encoders, waiting while too many are pending */
+static void exportSubmit(long frame,const void * pixels) {
+  size_t size = (size_t) exportWidth * exportHeight * 4;
+  exportJob * job = malloc(sizeof(exportJob));
+  job->frame = frame;
+  job->pixels = malloc(size);
+  job->next = NULL;
+  memcpy(job->pixels,pixels,size);
+  mtx_lock(& exportLock);
+  while (exportQueued >= 2 * exportWorkers) {
+      cnd_wait(& exportRoom,& exportLock);
+  }
+  if (exportTail) {
+      exportTail->next = job;
+  } else {
+      exportHead = job;
+  }
+  exportTail = job;
+  exportQueued += 1;
+  cnd_signal(& exportReady);
+  mtx_unlock(& exportLock);
 }
 
-void writeRange(void) {
-    FILE * f = fopen(RANGE_FILENAME,"w");
-    fprintf(f,"%f\n",range);
-    fflush(f);
-    fclose(f);
-    printf("wrote range = %f to '%s'\n",range,RANGE_FILENAME);
-    fflush(stdout);
+static void exportBegin(int width,int height) {
+  int i;
+  exportWidth = width;
+  exportHeight = height;
+  if (exportWorkers <= 0) {
+      exportWorkers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  exportWorkers = exportWorkers < 1 ? 1 : exportWorkers;
+  exportWorkers = exportWorkers > EXPORT_MAX_WORKERS ? EXPORT_MAX_WORKERS : exportWorkers;
+  mtx_init(& exportLock,mtx_plain);
+  cnd_init(& exportReady);
+  cnd_init(& exportRoom);
+  for (i = 0;i < exportWorkers;i += 1) {
+      thrd_create(& exportThreads[i],exportWorker,NULL);
+  }
+  if (GLAD_GL_VERSION_2_1) {
+      glGenBuffers(EXPORT_RING,exportPbo);
+      for (i = 0;i < EXPORT_RING;i += 1) {
+          glBindBuffer(GL_PIXEL_PACK_BUFFER,exportPbo[i]);
+          glBufferData(GL_PIXEL_PACK_BUFFER,(GLsizeiptr) width * height * 4,NULL,GL_STREAM_READ);
+          exportPboFrame[i] = -1;
+      }
+      glBindBuffer(GL_PIXEL_PACK_BUFFER,0);
+  }
+  glPixelStorei(GL_PACK_ALIGNMENT,4);
+  glReadBuffer(GL_BACK);
+}
+
+/* hand the frame read into ring slot i to the encoders */
+static void exportCollect(int i) {
+  if (exportPboFrame[i] < 0) return;
+  glBindBuffer(GL_PIXEL_PACK_BUFFER,exportPbo[i]);
+  void * pixels = glMapBuffer(GL_PIXEL_PACK_BUFFER,GL_READ_ONLY);
+  if (pixels) {
+      exportSubmit(exportPboFrame[i],pixels);
+      glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+  }
+  glBindBuffer(GL_PIXEL_PACK_BUFFER,0);
+  exportPboFrame[i] = -1;
+}
+
+/* start reading back the frame just drawn */
+static void exportFrame(long frame) {
+  if (! GLAD_GL_VERSION_2_1) {
+      unsigned char * pixels = malloc((size_t) exportWidth * exportHeight * 4);
+      glReadPixels(0,0,exportWidth,exportHeight,GL_RGBA,GL_UNSIGNED_BYTE,pixels);
+      exportSubmit(frame,pixels);
+      free(pixels);
+      return;
+  }
+  int i = (int) (frame % EXPORT_RING);
+  exportCollect(i);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER,exportPbo[i]);
+  glReadPixels(0,0,exportWidth,exportHeight,GL_RGBA,GL_UNSIGNED_BYTE,NULL);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER,0);
+  exportPboFrame[i] = frame;
+}
+
+/* drain the ring and wait for the encoders to finish */
+static void exportEnd(long frame) {
+  int i,n;
+  if (GLAD_GL_VERSION_2_1) {
+      for (n = 0;n < EXPORT_RING;n += 1) {
+          exportCollect((int) ((frame + n) % EXPORT_RING));
+      }
+      glDeleteBuffers(EXPORT_RING,exportPbo);
+  }
+  mtx_lock(& exportLock);
+  exportDone = 1;
+  cnd_broadcast(& exportReady);
+  mtx_unlock(& exportLock);
+  for (i = 0;i < exportWorkers;i += 1) {
+      thrd_join(exportThreads[i],NULL);
+  }
+  cnd_destroy(& exportRoom);
+  cnd_destroy(& exportReady);
+  mtx_destroy(& exportLock);
+}
+
+/* render frames exportFirst..exportLast of the timeline to files */
+static void exportRun(GLFWwindow * window) {
+  int width,height;
+  long i;
+  glfwGetFramebufferSize(window,& width,& height);
+  exportBegin(width,height);
+  printf("exporting frames %ld..%ld [%dx%d] to '%s' with %d encoders\n",
+      exportFirst,exportLast,width,height,exportPattern,exportWorkers);
+  fflush(stdout);
+  // Fast-forward so frame N looks as it would in a run from frame 0
+  for (i = 0;i < exportFirst;i += 1) {
+      tlAdvance();
+  }
+  double start = glfwGetTime();
+  for (i = exportFirst;i <= exportLast && !glfwWindowShouldClose(window);i += 1) {
+      animate();
+      draw1();
+      draw2();
+      exportFrame(i);
+      glfwPollEvents();
+  }
+  exportEnd(i);
+  double elapsed = glfwGetTime() - start;
+  printf("exported %ld frames in %.2f s (%.1f fps)\n",i - exportFirst,
+      elapsed,elapsed > 0.0 ? (i - exportFirst) / elapsed : 0.0);
+  fflush(stdout);
+}
+
+#ifdef GEARS_BENCH
+/* Benchmark.  gears_bench is gears.c built with GEARS_BENCH: no state
+   files are read or written, the window is hidden, vsync and pacing are
+   off and the timeline steps by -dt.  After BENCH_WARMUP untimed frames
+   it draws -frames frames and prints the results as JSON.  stdout carries
+   nothing but the JSON: main points file descriptor 1 at stderr, so every
+   diagnostic lands there, and keeps the real stdout in benchStdout. */
+#define BENCH_WARMUP 10
+static long benchFrames = 600;
+static const char * benchOutput = NULL; /* JSON file, stdout if NULL */
+static FILE * benchStdout = NULL;
+
+static void benchRun(GLFWwindow * window) {
+  int width,height;
+  long i,n;
+  int p;
+  double phase[PHASES] = {0.0};
+  double vertices = 0.0, triangles = 0.0, drawCalls = 0.0, glCalls = 0.0, elided = 0.0;
+  double culled = 0.0;
+  double * frameTimes = malloc(sizeof(double) * benchFrames);
+  glfwGetFramebufferSize(window,& width,& height);
+  for (i = 0; i < BENCH_WARMUP + benchFrames; i += 1) {
+      if (i == BENCH_WARMUP) {
+          glFinish();
+          statsSwap = glfwGetTime();
+      }
+      statsMark = glfwGetTime();
+      animate();
+      statsPhase(PHASE_ANIMATE);
+      dynresBegin();
+      draw1();
+      statsPhase(PHASE_DRAW1);
+      draw2();
+      dynresEnd();
+      glfwSwapBuffers(window);
+      statsPhase(PHASE_SWAP);
+      statsEnd();
+      if (i >= BENCH_WARMUP) {
+          const frameStats * fs = & statsRing[(statsCount - 1) % STATS_FRAMES];
+          frameTimes[i - BENCH_WARMUP] = fs->frameTime;
+          for (p = 0; p < PHASES; p += 1) {
+              phase[p] += fs->phase[p];
+          }
+          vertices += fs->vertices;
+          triangles += fs->triangles;
+          drawCalls += fs->drawCalls;
+          glCalls += fs->glCalls;
+          elided += fs->materialsElided;
+          culled += fs->culled;
+      }
+  }
+  n = benchFrames;
+  double seconds = 0.0;
+  for (i = 0; i < benchFrames; i += 1) {
+      seconds += frameTimes[i];
+  }
+  qsort(frameTimes,n,sizeof(double),statsCompare);
+  FILE * f = benchOutput ? fopen(benchOutput,"w") : benchStdout;
+  if (! f) {
+      fprintf(stderr,"cannot write '%s'\n",benchOutput);
+      f = benchStdout;
+  }
+  fprintf(f,"{\n");
+  fprintf(f,"  \"frames\": %ld,\n",benchFrames);
+  fprintf(f,"  \"dt\": %g,\n",tlDt);
+  fprintf(f,"  \"width\": %d,\n  \"height\": %d,\n",width,height);
+  fprintf(f,"  \"fast\": %d,\n  \"venus\": %d,\n  \"warm\": %d,\n",FAST,VENUS,WARM);
+  fprintf(f,"  \"instancing\": %d,\n  \"mirror_mask\": %d,\n",useInstancing,mirrorMask);
+  fprintf(f,"  \"seconds\": %.6f,\n",seconds);
+  fprintf(f,"  \"fps\": %.3f,\n",seconds > 0.0 ? benchFrames / seconds : 0.0);
+  fprintf(f,"  \"frame_ms\": {\"mean\": %.4f, \"p50\": %.4f, \"p95\": %.4f, \"p99\": %.4f},\n",
+      1000.0 * seconds / n,1000.0 * frameTimes[(n - 1) * 50 / 100],
+      1000.0 * frameTimes[(n - 1) * 95 / 100],1000.0 * frameTimes[(n - 1) * 99 / 100]);
+  fprintf(f,"  \"phase_ms\": {\"animate\": %.4f, \"draw1\": %.4f, \"draw2\": %.4f, "
+      "\"mirror\": %.4f, \"swap\": %.4f},\n",
+      1000.0 * phase[PHASE_ANIMATE] / n,1000.0 * phase[PHASE_DRAW1] / n,
+      1000.0 * phase[PHASE_DRAW2] / n,1000.0 * phase[PHASE_MIRROR] / n,
+      1000.0 * phase[PHASE_SWAP] / n);
+  fprintf(f,"  \"vertices_per_frame\": %.1f,\n",vertices / n);
+  fprintf(f,"  \"triangles_per_frame\": %.1f,\n",triangles / n);
+  fprintf(f,"  \"triangles_per_sec\": %.1f,\n",seconds > 0.0 ? triangles / seconds : 0.0);
+  fprintf(f,"  \"draw_calls_per_frame\": %.1f,\n",drawCalls / n);
+  fprintf(f,"  \"gl_calls_per_frame\": %.1f,\n",glCalls / n);
+  fprintf(f,"  \"materials_elided_per_frame\": %.1f,\n",elided / n);
+  fprintf(f,"  \"culled_per_frame\": %.1f\n",culled / n);
+  fprintf(f,"}\n");
+  fclose(f);
+  free(frameTimes);
 }
+#endif
 
 int main(int argc, char *argv[]) {
     GLFWwindow * window;
     int width, height;
+#ifdef GEARS_BENCH
+    benchStdout = fdopen(dup(STDOUT_FILENO),"w");
+    dup2(STDERR_FILENO,STDOUT_FILENO);
+#endif
     setResolution(0);
-    readDefault();
-    readTimeOffset();
-    readRotx();
-    readRoty();
-    readCamHeight();
-    readFloorOffset();
-    readRange();
+#ifndef GEARS_BENCH
+    configLoad();
+    configWatch();
+#endif
     if ( !glfwInit() ) {
         fprintf( stderr, "Failed to initialize GLFW\n" );
         exit( EXIT_FAILURE );
@@ -1285,6 +3828,8 @@ int main(int argc, char *argv[]) {
     int i;
     int cmdResSwitch = 0;
     int cmdRes = 0;
+    int seekSwitch = 0;
+    double seekTime = 0.0;
     if (argc >= 2) {
         // parse command line arguments
         for (i = 1;i < argc;i += 1) {
@@ -1312,18 +3857,106 @@ int main(int argc, char *argv[]) {
                 VENUS = 1; // use Venus fly trap design
             } else if (0 == strcmp("-nov",argv[i])) {
                 VENUS = 0; // don't use Venus fly trap design; objet d'art
+            } else if (0 == strcmp("-f",argv[i])) {
+                FAST = 1; // fast rate of mobile shape change
+            } else if (0 == strcmp("-nof",argv[i])) {
+                FAST = 0;
             } else if (0 == strcmp("-w",argv[i])) {
                 WARM = 1; // warm circuits
             } else if (0 == strcmp("-now",argv[i])) {
                 WARM = 0; // don't warm circuits; cat temperature
+            } else if (0 == strcmp("-noi",argv[i])) {
+                useInstancing = 0; // draw Sols one fold at a time
+            } else if (0 == strcmp("-threads",argv[i]) && i + 1 < argc) {
+                solThreads = atoi(argv[++i]); // Sol workers besides the render thread
+            } else if (0 == strcmp("-dynres",argv[i]) && i + 2 < argc) {
+                dynres = 1; // offscreen resolution between min and max
+                dynresMin = atof(argv[++i]);
+                dynresMax = atof(argv[++i]);
+            } else if (0 == strcmp("-nolod",argv[i])) {
+                useLod = 0; // every cone at FACES
+            } else if (0 == strcmp("-lod",argv[i]) && i + 1 < argc) {
+                useLod = 1; // cone level of detail from projected size
+                lodThreshold = atof(argv[++i]); // cone arc error in pixels
+            } else if (0 == strcmp("-core",argv[i])) {
+                useCore = 1; // 3.3 core context, GLSL renderer
+            } else if (0 == strcmp("-m4",argv[i])) {
+                mirrorMask = 0xf; // four-way symmetry
+            } else if (0 == strcmp("-dt",argv[i]) && i + 1 < argc) {
+                tlFixed = 1; // step the timeline by a fixed amount per frame
+                tlDt = atof(argv[++i]);
+            } else if (0 == strcmp("-seek",argv[i]) && i + 1 < argc) {
+                seekSwitch = 1; // start the timeline at this time
+                seekTime = atof(argv[++i]);
+            } else if (0 == strcmp("-export",argv[i]) && i + 3 < argc) {
+                exporting = 1; // render frames first..last to files, headless
+                exportFirst = atol(argv[++i]);
+                exportLast = atol(argv[++i]);
+                exportPattern = argv[++i];
+                if (exportFirst < 0 || exportFirst > exportLast) {
+                    fprintf(stderr,"-export needs 0 <= first <= last\n");
+                    glfwTerminate();
+                    exit( EXIT_FAILURE );
+                }
+                if (! exportCheckPattern(exportPattern)) {
+                    fprintf(stderr,"-export needs a pattern with one integer conversion, like gears%%05d.png\n");
+                    glfwTerminate();
+                    exit( EXIT_FAILURE );
+                }
+                const char * ext = strrchr(exportPattern,'.');
+                exportFormat = ! ext ? EXPORT_RAW :
+                    0 == strcmp(ext,".png") ? EXPORT_PNG :
+                    0 == strcmp(ext,".ppm") ? EXPORT_PPM : EXPORT_RAW;
+            } else if (0 == strcmp("-hz",argv[i]) && i + 1 < argc) {
+                paceRate = atof(argv[++i]); // target frame rate
+                paceRate = paceRate > 0.0 ? paceRate : 60.0;
+            } else if (0 == strcmp("-stats",argv[i])) {
+                statsOverlay = 1; // frame statistics in the HUD
+            } else if (0 == strcmp("-uncapped",argv[i])) {
+                paceUncapped = 1; // benchmark: no sleep, no vsync
+            } else if (0 == strcmp("-jobs",argv[i]) && i + 1 < argc) {
+                exportWorkers = atoi(argv[++i]); // encoder threads for -export
+#ifdef GEARS_BENCH
+            } else if (0 == strcmp("-frames",argv[i]) && i + 1 < argc) {
+                benchFrames = atol(argv[++i]); // timed frames
+                if (benchFrames <= 0) {
+                    fprintf(stderr,"-frames needs a positive count\n");
+                    glfwTerminate();
+                    exit( EXIT_FAILURE );
+                }
+            } else if (0 == strcmp("-o",argv[i]) && i + 1 < argc) {
+                benchOutput = argv[++i]; // JSON results file
+#endif
             }
         }
     }
+    if (dynres) {
+        dynresMax = dynresMax < 0.1 ? 0.1 : dynresMax > 2.0 ? 2.0 : dynresMax;
+        dynresMin = dynresMin < 0.1 ? 0.1 : dynresMin > dynresMax ? dynresMax : dynresMin;
+        dynresScale = dynresMax;
+        dynres = !exporting; /* exported frames are always full size */
+    }
     if (cmdResSwitch) {
         setResolution(cmdRes);
         printf("set resolution=%d [%dx%d] \n",cmdRes,
             resWidth[cmdRes],resHeight[cmdRes]);
     }
+#ifdef GEARS_BENCH
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    tlFixed = 1;
+    paceUncapped = 1;
+#endif
+    if (exporting) {
+        // offscreen like the offscreen example; the timeline never follows the clock
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+        tlFixed = 1;
+    }
+    if (useCore) {
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+        glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+        glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GLFW_TRUE);
+    }
     FAST2 = FAST;
     VENUS2 = VENUS;
     WARM2 = WARM;
@@ -1339,18 +3972,38 @@ int main(int argc, char *argv[]) {
     glfwSetCursorPosCallback(window,cursor);
     glfwMakeContextCurrent(window);
     gladLoadGL(glfwGetProcAddress);
-    glfwSwapInterval(1);
+    glfwSwapInterval(exporting || paceUncapped ? 0 : 1);
     glfwGetFramebufferSize(window,& width,& height);
     reshape(window,width,height);
     // Parse command-line options
     init();
+    tlSeek(seekSwitch ? seekTime : timeOffset);
     // Main loop
     int xpos,ypos;
     float epsilon = 0.05;
     xHUDscale -= epsilon;
     HUDscale -= epsilon;
+#ifdef GEARS_BENCH
+    benchRun(window);
+    glfwDestroyWindow(window);
+    glfwTerminate();
+    exit( EXIT_SUCCESS );
+#endif
+    if (exporting) {
+        exportRun(window);
+        glfwDestroyWindow(window);
+        glfwTerminate();
+        exit( EXIT_SUCCESS );
+    }
     while( !glfwWindowShouldClose(window) ) {
-        usleep(15000);
+        paceWait();
+#ifndef GEARS_BENCH
+        if (configChanged() && configReload()) {
+            glfwSetWindowSize(window,windowWidth,windowHeight);
+            glfwGetFramebufferSize(window,& width,& height);
+            reshape(window,width,height);
+        }
+#endif
         if (sizeChange) {
             glfwGetWindowPos(window,& xpos,& ypos);
             xpos -= 5;
@@ -1365,61 +4018,31 @@ int main(int argc, char *argv[]) {
             sizeChange = 0;
         }
         // Update animation
+        statsMark = glfwGetTime();
         animate();
+        statsPhase(PHASE_ANIMATE);
         // Draw gears
-        flipWorld = 0;
+        dynresBegin();
         draw1();
+        statsPhase(PHASE_DRAW1);
         draw2();
-
-        // left-right mirror
-        glPushMatrix();
-        glScalef(-1.0,1.0,1.0);
-        // change position of light to other side of scene
-        lightpos[0] = - lightpos[0];
-        glLightfv(GL_LIGHT0, GL_POSITION, lightpos);
-        lightpos[0] = - lightpos[0];
-        flipWorld = 1;
-        draw2();
-        glPopMatrix();
-
-        /*
-        // top-bottom mirror
-        glPushMatrix();
-        glScalef(1.0,-1.0,1.0);
-        // change position of light to other side of scene
-        lightpos[1] = - lightpos[1];
-        glLightfv(GL_LIGHT0, GL_POSITION, lightpos);
-        lightpos[1] = - lightpos[1];
-        flipWorld = 1;
-        draw2();
-        glPopMatrix();
-
-        // 180 degree rotation
-        glPushMatrix();
-        glScalef(-1.0,-1.0,1.0);
-        // change position of light to other side of scene
-        lightpos[0] = - lightpos[0];
-        lightpos[1] = - lightpos[1];
-        glLightfv(GL_LIGHT0, GL_POSITION, lightpos);
-        lightpos[0] = - lightpos[0];
-        lightpos[1] = - lightpos[1];
-        flipWorld = 0;
-        draw2();
-        glPopMatrix();
-        */
+        dynresEnd();
 
         // Swap buffers
+        paceSubmit();
         glfwSwapBuffers(window);
+        paceSwapped();
+        statsPhase(PHASE_SWAP);
+        statsEnd();
         glfwPollEvents();
     }
     glfwDestroyWindow(window);
-    writeDefault();
-    writeTimeOffset();
-    writeRotx();
-    writeRoty();
-    writeCamHeight();
-    writeFloorOffset();
-    writeRange();
+    if (statsCsv) {
+        statsToggleCsv();
+    }
+#ifndef GEARS_BENCH
+    configSave();
+#endif
     // Terminate GLFW
     glfwTerminate();
     // Exit program
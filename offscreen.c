@@ -32,13 +32,13 @@
  #include <GLFW/glfw3native.h>
 #endif
 
+#include <tinycthread.h>
+#include <getopt.h>
 #include "linmath.h"
 
 #include <stdlib.h>
 #include <stdio.h>
-
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include <stb_image_write.h>
+#include <string.h>
 
 static const struct
 {
@@ -71,20 +71,1127 @@ static const char* fragment_shader_text =
 "    gl_FragColor = vec4(color, 1.0);\n"
 "}\n";
 
+// Frames read back but not yet copied out, one pixel buffer object each
+#define RING_SIZE 3
+#define MAX_ENCODERS 16
+
+// PNG images are deflated in strips of about this many bytes, in parallel
+#define STRIP_BYTES 262144
+#define HASH_BITS 15
+#define WINDOW_SIZE 32768
+
+enum
+{
+    STAGE_RENDER,
+    STAGE_READBACK,
+    STAGE_QUEUE,
+    STAGE_ENCODE,
+    STAGE_COUNT
+};
+
+static const char* stage_names[STAGE_COUNT] =
+{
+    "render", "readback", "queue", "encode"
+};
+
+// A frame whose pixels are on their way back from the GPU
+typedef struct
+{
+    GLuint buffer;  // Pixel buffer object, or zero to read into pixels
+    GLsync fence;
+    char* pixels;
+    int index;
+    int pending;
+    double rendered;
+} Slot;
+
+enum
+{
+    JOB_FREE,
+    JOB_QUEUED,
+    JOB_BUSY
+};
+
+enum
+{
+    FORMAT_PNG,
+    FORMAT_QOI,
+    FORMAT_PAM,
+    FORMAT_PPM,
+    FORMAT_COUNT
+};
+
+static const char* format_names[FORMAT_COUNT] =
+{
+    "png", "qoi", "pam", "ppm"
+};
+
+enum
+{
+    STRIP_IDLE,
+    STRIP_QUEUED,
+    STRIP_BUSY
+};
+
+// A band of PNG scanlines filtered and deflated on its own, ending on a
+// byte boundary so that the strips of an image can simply be concatenated
+typedef struct
+{
+    const char* pixels;
+    int first, count;
+    int last;
+    int state;
+    unsigned char* filtered;
+    unsigned char* scratch;
+    unsigned char* data;
+    size_t size;
+    unsigned long adler;
+} Strip;
+
+// A frame in system memory waiting for or being encoded
+typedef struct
+{
+    char* pixels;
+    int index;
+    int state;
+    double queued;
+    Strip* strips;
+    int strips_queued;
+    int strips_left;
+} Job;
+
+typedef struct
+{
+    unsigned char* data;
+    size_t size;
+    unsigned long bits;
+    int count;
+} BitWriter;
+
+static struct
+{
+    mtx_t lock;
+    cnd_t queued;   // Condition: a job was queued or the last one was
+    cnd_t released; // Condition: a job was encoded and is free again
+    Job* jobs;
+    int job_count;
+    int finished;
+    double bytes;
+    double stage_total[STAGE_COUNT];
+    double stage_max[STAGE_COUNT];
+    int stage_count[STAGE_COUNT];
+} pipeline;
+
+static int width, height;
+static int format = FORMAT_PNG;
+static int level = 6;
+static int strip_count;
+static const char* output = NULL;
+
+// Fixed Huffman codes of RFC 1951, stored bit-reversed for an LSB-first writer
+static unsigned short literal_codes[288];
+static unsigned char literal_lengths[288];
+static unsigned char distance_codes[30];
+static unsigned char length_symbols[259];
+static unsigned char distance_symbols[512];
+
+static const unsigned short length_base[29] =
+{
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+
+static const unsigned char length_extra[29] =
+{
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+
+static const unsigned short distance_base[30] =
+{
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577
+};
+
+static const unsigned char distance_extra[30] =
+{
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+// How many earlier positions a match search may look at, per level
+static const int chain_limits[10] =
+{
+    0, 4, 8, 16, 32, 64, 128, 256, 1024, 4096
+};
+
+static unsigned long crc_table[256];
+static unsigned char* zero_row;
+
 static void error_callback(int error, const char* description)
 {
     fprintf(stderr, "Error: %s\n", description);
 }
 
-int main(void)
+static void usage(void)
+{
+    printf("Usage: offscreen [-h] [-n FRAMES] [-j ENCODERS] [-f FORMAT] [-c LEVEL] [-o PATTERN]\n");
+    printf("Options:\n");
+    printf(" -h   Display this help\n");
+    printf(" -n   Number of frames to render (default 1)\n");
+    printf(" -j   Number of encoder threads (default 2)\n");
+    printf(" -f   Output format: png, qoi, pam or ppm (default png)\n");
+    printf(" -c   PNG compression level from 0 (stored) to 9 (smallest, default 6)\n");
+    printf(" -o   Output file name, a printf pattern taking the frame number\n");
+    printf("      (default offscreen.png for one frame, else offscreen%%04d.png)\n");
+}
+
+// Returns how many integer conversions the output pattern has, or -1 if it
+// has any conversion other than a plain int one
+static int count_conversions(const char* pattern)
+{
+    int count = 0;
+
+    for (;  *pattern;  pattern++)
+    {
+        if (*pattern != '%')
+            continue;
+
+        pattern++;
+        if (*pattern == '%')
+            continue;
+
+        pattern += strspn(pattern, "-+ #0");
+        pattern += strspn(pattern, "0123456789");
+        if (*pattern == '.')
+        {
+            pattern++;
+            pattern += strspn(pattern, "0123456789");
+        }
+
+        if (!*pattern || !strchr("diouxX", *pattern))
+            return -1;
+
+        count++;
+    }
+
+    return count;
+}
+
+static unsigned int reverse_bits(unsigned int code, int length)
+{
+    unsigned int result = 0;
+
+    while (length--)
+    {
+        result = (result << 1) | (code & 1);
+        code >>= 1;
+    }
+
+    return result;
+}
+
+static void init_tables(void)
+{
+    int i, j;
+
+    for (i = 0;  i < 288;  i++)
+    {
+        if (i < 144)
+            literal_lengths[i] = 8, literal_codes[i] = reverse_bits(0x30 + i, 8);
+        else if (i < 256)
+            literal_lengths[i] = 9, literal_codes[i] = reverse_bits(0x190 + i - 144, 9);
+        else if (i < 280)
+            literal_lengths[i] = 7, literal_codes[i] = reverse_bits(i - 256, 7);
+        else
+            literal_lengths[i] = 8, literal_codes[i] = reverse_bits(0xc0 + i - 280, 8);
+    }
+
+    for (i = 0;  i < 30;  i++)
+        distance_codes[i] = reverse_bits(i, 5);
+
+    for (i = 0;  i < 29;  i++)
+    {
+        for (j = length_base[i];  j <= 258;  j++)
+            length_symbols[j] = i;
+    }
+
+    // Distances up to 256 index directly, longer ones by 128 byte steps
+    for (i = 0;  i < 30;  i++)
+    {
+        for (j = distance_base[i];  j <= 256;  j++)
+            distance_symbols[j - 1] = i;
+        for (j = (distance_base[i] - 1) >> 7;  j < 256;  j++)
+        {
+            if (distance_base[i] > 256)
+                distance_symbols[256 + j] = i;
+        }
+    }
+
+    for (i = 0;  i < 256;  i++)
+    {
+        unsigned long c = i;
+
+        for (j = 0;  j < 8;  j++)
+            c = c & 1 ? 0xedb88320ul ^ (c >> 1) : c >> 1;
+
+        crc_table[i] = c;
+    }
+}
+
+static unsigned long update_crc(unsigned long crc, const unsigned char* data, size_t size)
+{
+    crc ^= 0xfffffffful;
+    while (size--)
+        crc = crc_table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    return crc ^ 0xfffffffful;
+}
+
+static unsigned long update_adler(unsigned long adler, const unsigned char* data, size_t size)
+{
+    unsigned long a = adler & 0xffff, b = adler >> 16;
+
+    while (size)
+    {
+        // The largest run that cannot overflow 32 bits before the modulo
+        size_t run = size < 5552 ? size : 5552;
+        size -= run;
+
+        while (run--)
+        {
+            a += *data++;
+            b += a;
+        }
+
+        a %= 65521;
+        b %= 65521;
+    }
+
+    return a | (b << 16);
+}
+
+// The checksum of two runs from theirs, as done by zlib's adler32_combine
+static unsigned long combine_adler(unsigned long first, unsigned long second, size_t size)
+{
+    const unsigned long base = 65521;
+    const unsigned long rem = (unsigned long) (size % base);
+    unsigned long a = first & 0xffff;
+    unsigned long b = (rem * a) % base;
+
+    a += (second & 0xffff) + base - 1;
+    b += (first >> 16) + (second >> 16) + base - rem;
+    if (a >= base)
+        a -= base;
+    if (a >= base)
+        a -= base;
+    if (b >= base << 1)
+        b -= base << 1;
+    if (b >= base)
+        b -= base;
+
+    return a | (b << 16);
+}
+
+static void put_bits(BitWriter* writer, unsigned long value, int count)
+{
+    writer->bits |= value << writer->count;
+    writer->count += count;
+
+    while (writer->count >= 8)
+    {
+        writer->data[writer->size++] = (unsigned char) writer->bits;
+        writer->bits >>= 8;
+        writer->count -= 8;
+    }
+}
+
+static void align_bits(BitWriter* writer)
+{
+    if (writer->count)
+        put_bits(writer, 0, 8 - writer->count);
+}
+
+static void put_literal(BitWriter* writer, int symbol)
+{
+    put_bits(writer, literal_codes[symbol], literal_lengths[symbol]);
+}
+
+static void put_match(BitWriter* writer, int length, int distance)
+{
+    const int l = length_symbols[length];
+    const int d = distance <= 256 ? distance_symbols[distance - 1]
+                                  : distance_symbols[256 + ((distance - 1) >> 7)];
+
+    put_literal(writer, 257 + l);
+    put_bits(writer, length - length_base[l], length_extra[l]);
+    put_bits(writer, distance_codes[d], 5);
+    put_bits(writer, distance - distance_base[d], distance_extra[d]);
+}
+
+static unsigned int hash_bytes(const unsigned char* data)
+{
+    const unsigned int key = data[0] | (data[1] << 8) | (data[2] << 16);
+    return (key * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Greedy LZ77 into a single block with the fixed Huffman codes
+static void deflate_fixed(BitWriter* writer, const unsigned char* data, int size, int last)
+{
+    int i = 0;
+    int* head = malloc(sizeof(int) << HASH_BITS);
+    int* prev = malloc(sizeof(int) * WINDOW_SIZE);
+
+    memset(head, 0xff, sizeof(int) << HASH_BITS);
+
+    put_bits(writer, last, 1);
+    put_bits(writer, 1, 2);
+
+    while (i < size)
+    {
+        int best_length = 0, best_distance = 0;
+
+        if (i + 3 <= size)
+        {
+            const unsigned int hash = hash_bytes(data + i);
+            const int limit = size - i < 258 ? size - i : 258;
+            int candidate = head[hash];
+            int chain = chain_limits[level];
+
+            while (candidate >= 0 && i - candidate <= WINDOW_SIZE && chain--)
+            {
+                int length = 0;
+                int next;
+
+                if (data[candidate + best_length] == data[i + best_length])
+                {
+                    while (length < limit && data[candidate + length] == data[i + length])
+                        length++;
+
+                    if (length > best_length)
+                    {
+                        best_length = length;
+                        best_distance = i - candidate;
+                        if (length == limit)
+                            break;
+                    }
+                }
+
+                next = prev[candidate & (WINDOW_SIZE - 1)];
+                if (next >= candidate)
+                    break;
+                candidate = next;
+            }
+
+            prev[i & (WINDOW_SIZE - 1)] = head[hash];
+            head[hash] = i;
+        }
+
+        if (best_length >= 3)
+        {
+            const int end = i + best_length;
+
+            put_match(writer, best_length, best_distance);
+
+            for (i++;  i < end;  i++)
+            {
+                if (i + 3 <= size)
+                {
+                    const unsigned int hash = hash_bytes(data + i);
+                    prev[i & (WINDOW_SIZE - 1)] = head[hash];
+                    head[hash] = i;
+                }
+            }
+        }
+        else
+            put_literal(writer, data[i++]);
+    }
+
+    put_literal(writer, 256);
+
+    free(head);
+    free(prev);
+}
+
+static void deflate_stored(BitWriter* writer, const unsigned char* data, int size, int last)
+{
+    while (size)
+    {
+        const int run = size < 65535 ? size : 65535;
+        size -= run;
+
+        put_bits(writer, last && !size, 1);
+        put_bits(writer, 0, 2);
+        align_bits(writer);
+        put_bits(writer, run, 16);
+        put_bits(writer, run ^ 0xffff, 16);
+        memcpy(writer->data + writer->size, data, run);
+        writer->size += run;
+        data += run;
+    }
+}
+
+static unsigned char paeth(int a, int b, int c)
+{
+    const int p = a + b - c;
+    const int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+
+    if (pa <= pb && pa <= pc)
+        return a;
+    if (pb <= pc)
+        return b;
+    return c;
+}
+
+static void apply_filter(unsigned char* out, const unsigned char* row,
+                         const unsigned char* up, int type)
+{
+    int i;
+    const int size = width * 4;
+
+    out[0] = type;
+    out++;
+
+    switch (type)
+    {
+        case 0:
+            memcpy(out, row, size);
+            break;
+        case 1:
+            memcpy(out, row, 4);
+            for (i = 4;  i < size;  i++)
+                out[i] = row[i] - row[i - 4];
+            break;
+        case 2:
+            for (i = 0;  i < size;  i++)
+                out[i] = row[i] - up[i];
+            break;
+        case 3:
+            for (i = 0;  i < 4;  i++)
+                out[i] = row[i] - (up[i] >> 1);
+            for (i = 4;  i < size;  i++)
+                out[i] = row[i] - ((row[i - 4] + up[i]) >> 1);
+            break;
+        case 4:
+            for (i = 0;  i < 4;  i++)
+                out[i] = row[i] - up[i];
+            for (i = 4;  i < size;  i++)
+                out[i] = row[i] - paeth(row[i - 4], up[i], up[i - 4]);
+            break;
+    }
+}
+
+// Filters one scanline with whichever PNG filter gives the smallest sum of
+// absolute differences, the usual heuristic for picking one per row; the
+// lower levels only try the two cheapest
+static void filter_row(unsigned char* out, unsigned char* scratch,
+                       const unsigned char* row, const unsigned char* up)
+{
+    int type, i;
+    const int size = width * 4;
+    const int types = level == 0 ? 1 : level < 4 ? 3 : 5;
+    int best_sum = -1;
+
+    for (type = level ? 1 : 0;  type < types;  type++)
+    {
+        int sum = 0;
+
+        apply_filter(scratch, row, up, type);
+
+        for (i = 1;  i <= size;  i++)
+            sum += abs((signed char) scratch[i]);
+
+        if (best_sum < 0 || sum < best_sum)
+        {
+            memcpy(out, scratch, 1 + size);
+            best_sum = sum;
+        }
+    }
+}
+
+static void compress_strip(Strip* strip)
+{
+    int y;
+    BitWriter writer = { strip->data, 0, 0, 0 };
+    const int stride = 1 + width * 4;
+    const int size = strip->count * stride;
+
+    // Rows go top-down, the pixels bottom-up because OpenGL
+    for (y = strip->first;  y < strip->first + strip->count;  y++)
+    {
+        const unsigned char* row =
+            (const unsigned char*) strip->pixels + (height - 1 - y) * width * 4;
+
+        filter_row(strip->filtered + (y - strip->first) * stride, strip->scratch,
+                   row, y ? row + width * 4 : zero_row);
+    }
+
+    if (level)
+        deflate_fixed(&writer, strip->filtered, size, strip->last);
+    else
+        deflate_stored(&writer, strip->filtered, size, strip->last);
+
+    // An empty stored block brings all but the last strip to a byte
+    // boundary without ending the stream, like zlib's Z_SYNC_FLUSH
+    if (!strip->last && level)
+    {
+        put_bits(&writer, 0, 3);
+        align_bits(&writer);
+        put_bits(&writer, 0, 16);
+        put_bits(&writer, 0xffff, 16);
+    }
+
+    align_bits(&writer);
+
+    strip->size = writer.size;
+    strip->adler = update_adler(1, strip->filtered, size);
+}
+
+// Must be called with the pipeline lock held
+static void record_stage(int stage, double seconds)
+{
+    pipeline.stage_total[stage] += seconds;
+    pipeline.stage_count[stage]++;
+    if (seconds > pipeline.stage_max[stage])
+        pipeline.stage_max[stage] = seconds;
+}
+
+// Must be called with the pipeline lock held
+static Job* next_queued_job(void)
+{
+    int i;
+    Job* oldest = NULL;
+
+    for (i = 0;  i < pipeline.job_count;  i++)
+    {
+        Job* job = pipeline.jobs + i;
+        if (job->state == JOB_QUEUED && (!oldest || job->index < oldest->index))
+            oldest = job;
+    }
+
+    return oldest;
+}
+
+// Must be called with the pipeline lock held, prefers the strips of job
+static Strip* next_queued_strip(Job* job)
+{
+    int i, j;
+
+    if (job && job->strips_queued)
+        i = (int) (job - pipeline.jobs);
+    else
+        i = 0;
+
+    for (;  i < pipeline.job_count;  i++)
+    {
+        if (!pipeline.jobs[i].strips_queued)
+            continue;
+
+        for (j = 0;  j < strip_count;  j++)
+        {
+            if (pipeline.jobs[i].strips[j].state == STRIP_QUEUED)
+            {
+                pipeline.jobs[i].strips_queued--;
+                pipeline.jobs[i].strips[j].state = STRIP_BUSY;
+                return pipeline.jobs[i].strips + j;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+// Must be called with the pipeline lock held, which it drops while working
+static void run_strip(Strip* strip)
+{
+    int i;
+
+    mtx_unlock(&pipeline.lock);
+    compress_strip(strip);
+    mtx_lock(&pipeline.lock);
+
+    strip->state = STRIP_IDLE;
+
+    for (i = 0;  i < pipeline.job_count;  i++)
+    {
+        Job* job = pipeline.jobs + i;
+
+        if (strip >= job->strips && strip < job->strips + strip_count)
+        {
+            // Wake the owner if it is waiting on others to finish its strips
+            if (--job->strips_left == 0)
+                cnd_broadcast(&pipeline.queued);
+            break;
+        }
+    }
+}
+
+static void put_chunk(FILE* file, const char* type, const unsigned char* data, size_t size)
+{
+    const unsigned char header[8] =
+    {
+        size >> 24, size >> 16, size >> 8, size, type[0], type[1], type[2], type[3]
+    };
+    const unsigned long crc = update_crc(update_crc(0, header + 4, 4), data, size);
+    const unsigned char footer[4] = { crc >> 24, crc >> 16, crc >> 8, crc };
+
+    fwrite(header, 1, 8, file);
+    fwrite(data, 1, size, file);
+    fwrite(footer, 1, 4, file);
+}
+
+static size_t write_png(FILE* file, Job* job)
+{
+    int i;
+    Strip* strip;
+    unsigned char header[13] =
+    {
+        width >> 24, width >> 16, width >> 8, width,
+        height >> 24, height >> 16, height >> 8, height,
+        8, 6, 0, 0, 0
+    };
+    static const unsigned char signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+    // The check bits make the header a multiple of 31, as zlib requires
+    const unsigned char zlib_header[2] =
+    {
+        0x78, level < 2 ? 0x01 : level < 6 ? 0x5e : level == 6 ? 0x9c : 0xda
+    };
+    unsigned char length_type[8];
+    unsigned char trailer[8];
+    unsigned long adler = 1, crc;
+    size_t size = 2 + 4;
+
+    // Every encoder thread, this one included, helps deflate the strips
+    mtx_lock(&pipeline.lock);
+
+    for (i = 0;  i < strip_count;  i++)
+    {
+        job->strips[i].pixels = job->pixels;
+        job->strips[i].state = STRIP_QUEUED;
+    }
+
+    job->strips_queued = strip_count;
+    job->strips_left = strip_count;
+    cnd_broadcast(&pipeline.queued);
+
+    while (job->strips_left)
+    {
+        if ((strip = next_queued_strip(job)))
+            run_strip(strip);
+        else
+            cnd_wait(&pipeline.queued, &pipeline.lock);
+    }
+
+    mtx_unlock(&pipeline.lock);
+
+    for (i = 0;  i < strip_count;  i++)
+    {
+        const Strip* strip = job->strips + i;
+        const size_t filtered = (size_t) strip->count * (1 + width * 4);
+
+        adler = combine_adler(adler, strip->adler, filtered);
+        size += strip->size;
+    }
+
+    // One IDAT chunk written piecewise, its checksum built up along the way
+    length_type[0] = (unsigned char) (size >> 24);
+    length_type[1] = (unsigned char) (size >> 16);
+    length_type[2] = (unsigned char) (size >> 8);
+    length_type[3] = (unsigned char) size;
+    memcpy(length_type + 4, "IDAT", 4);
+
+    crc = update_crc(0, length_type + 4, 4);
+    crc = update_crc(crc, zlib_header, 2);
+    for (i = 0;  i < strip_count;  i++)
+        crc = update_crc(crc, job->strips[i].data, job->strips[i].size);
+
+    trailer[0] = (unsigned char) (adler >> 24);
+    trailer[1] = (unsigned char) (adler >> 16);
+    trailer[2] = (unsigned char) (adler >> 8);
+    trailer[3] = (unsigned char) adler;
+    crc = update_crc(crc, trailer, 4);
+    trailer[4] = (unsigned char) (crc >> 24);
+    trailer[5] = (unsigned char) (crc >> 16);
+    trailer[6] = (unsigned char) (crc >> 8);
+    trailer[7] = (unsigned char) crc;
+
+    fwrite(signature, 1, 8, file);
+    put_chunk(file, "IHDR", header, 13);
+    fwrite(length_type, 1, 8, file);
+    fwrite(zlib_header, 1, 2, file);
+    for (i = 0;  i < strip_count;  i++)
+        fwrite(job->strips[i].data, 1, job->strips[i].size, file);
+    fwrite(trailer, 1, 8, file);
+    put_chunk(file, "IEND", NULL, 0);
+
+    return 8 + 25 + 12 + size + 12;
+}
+
+// The Quite OK Image format, see https://qoiformat.org/qoi-specification.pdf
+static size_t write_qoi(FILE* file, Job* job)
+{
+    int x, y, run = 0;
+    unsigned char index[64][4];
+    unsigned char prev[4] = { 0, 0, 0, 255 };
+    unsigned char* data = malloc((size_t) width * height * 5 + 22);
+    unsigned char* out = data;
+    static const unsigned char padding[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+
+    memset(index, 0, sizeof(index));
+
+    memcpy(out, "qoif", 4);
+    out[4] = width >> 24;
+    out[5] = width >> 16;
+    out[6] = width >> 8;
+    out[7] = width;
+    out[8] = height >> 24;
+    out[9] = height >> 16;
+    out[10] = height >> 8;
+    out[11] = height;
+    out[12] = 4;
+    out[13] = 0;
+    out += 14;
+
+    for (y = 0;  y < height;  y++)
+    {
+        const unsigned char* row =
+            (const unsigned char*) job->pixels + (height - 1 - y) * width * 4;
+
+        for (x = 0;  x < width;  x++)
+        {
+            const unsigned char* px = row + x * 4;
+            int hash;
+
+            if (!memcmp(px, prev, 4))
+            {
+                // Flush at the longest run or the end of the image
+                if (++run == 62 || (y == height - 1 && x == width - 1))
+                {
+                    *out++ = 0xc0 | (run - 1);
+                    run = 0;
+                }
+                continue;
+            }
+
+            if (run)
+            {
+                *out++ = 0xc0 | (run - 1);
+                run = 0;
+            }
+
+            hash = (px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64;
+
+            if (!memcmp(index[hash], px, 4))
+                *out++ = hash;
+            else
+            {
+                memcpy(index[hash], px, 4);
+
+                if (px[3] == prev[3])
+                {
+                    const signed char dr = px[0] - prev[0];
+                    const signed char dg = px[1] - prev[1];
+                    const signed char db = px[2] - prev[2];
+                    const signed char dr_dg = dr - dg;
+                    const signed char db_dg = db - dg;
+
+                    if (dr > -3 && dr < 2 && dg > -3 && dg < 2 && db > -3 && db < 2)
+                        *out++ = 0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2);
+                    else if (dr_dg > -9 && dr_dg < 8 && dg > -33 && dg < 32 &&
+                             db_dg > -9 && db_dg < 8)
+                    {
+                        *out++ = 0x80 | (dg + 32);
+                        *out++ = (dr_dg + 8) << 4 | (db_dg + 8);
+                    }
+                    else
+                    {
+                        *out++ = 0xfe;
+                        *out++ = px[0];
+                        *out++ = px[1];
+                        *out++ = px[2];
+                    }
+                }
+                else
+                {
+                    *out++ = 0xff;
+                    memcpy(out, px, 4);
+                    out += 4;
+                }
+            }
+
+            memcpy(prev, px, 4);
+        }
+    }
+
+    memcpy(out, padding, 8);
+    out += 8;
+
+    fwrite(data, 1, out - data, file);
+    free(data);
+    return out - data;
+}
+
+// Uncompressed Netpbm, PAM keeping alpha and PPM dropping it
+static size_t write_netpbm(FILE* file, Job* job)
+{
+    int x, y;
+    const int channels = format == FORMAT_PAM ? 4 : 3;
+    unsigned char* line = malloc(width * channels);
+    size_t size;
+
+    if (format == FORMAT_PAM)
+    {
+        size = fprintf(file, "P7\nWIDTH %i\nHEIGHT %i\nDEPTH 4\nMAXVAL 255\n"
+                             "TUPLTYPE RGB_ALPHA\nENDHDR\n", width, height);
+    }
+    else
+        size = fprintf(file, "P6\n%i %i\n255\n", width, height);
+
+    for (y = 0;  y < height;  y++)
+    {
+        const unsigned char* row =
+            (const unsigned char*) job->pixels + (height - 1 - y) * width * 4;
+
+        if (channels == 4)
+            memcpy(line, row, width * 4);
+        else
+        {
+            for (x = 0;  x < width;  x++)
+                memcpy(line + x * 3, row + x * 4, 3);
+        }
+
+        fwrite(line, 1, width * channels, file);
+    }
+
+    free(line);
+    return size + (size_t) width * height * channels;
+}
+
+static int encoder_main(void* arg)
+{
+    char name[1024];
+
+    mtx_lock(&pipeline.lock);
+
+    for (;;)
+    {
+        double start;
+        size_t size = 0;
+        FILE* file;
+        Strip* strip;
+        Job* job = NULL;
+
+        // Strips of images already being encoded go before new images
+        while (!(strip = next_queued_strip(NULL)) &&
+               !(job = next_queued_job()) &&
+               !pipeline.finished)
+        {
+            cnd_wait(&pipeline.queued, &pipeline.lock);
+        }
+
+        if (strip)
+        {
+            run_strip(strip);
+            continue;
+        }
+
+        if (!job)
+            break;
+
+        job->state = JOB_BUSY;
+        start = glfwGetTime();
+        record_stage(STAGE_QUEUE, start - job->queued);
+        mtx_unlock(&pipeline.lock);
+
+        snprintf(name, sizeof(name), output, job->index);
+
+        file = fopen(name, "wb");
+        if (file)
+        {
+            if (format == FORMAT_PNG)
+                size = write_png(file, job);
+            else if (format == FORMAT_QOI)
+                size = write_qoi(file, job);
+            else
+                size = write_netpbm(file, job);
+
+            if (fclose(file))
+                size = 0;
+        }
+
+        if (!size)
+            fprintf(stderr, "Failed to write %s\n", name);
+
+        mtx_lock(&pipeline.lock);
+        record_stage(STAGE_ENCODE, glfwGetTime() - start);
+        pipeline.bytes += size;
+        job->state = JOB_FREE;
+        cnd_signal(&pipeline.released);
+    }
+
+    mtx_unlock(&pipeline.lock);
+    return 0;
+}
+
+// Waits for the slot's pixels and hands a copy to the encoders
+static void retire_slot(Slot* slot)
+{
+    int i;
+    Job* job = NULL;
+    const char* source;
+    double start;
+
+    mtx_lock(&pipeline.lock);
+
+    while (!job)
+    {
+        for (i = 0;  i < pipeline.job_count;  i++)
+        {
+            if (pipeline.jobs[i].state == JOB_FREE)
+            {
+                job = pipeline.jobs + i;
+                break;
+            }
+        }
+
+        if (!job)
+            cnd_wait(&pipeline.released, &pipeline.lock);
+    }
+
+    // Claim it so that the encoders leave it alone while we copy
+    job->state = JOB_BUSY;
+    mtx_unlock(&pipeline.lock);
+
+    start = glfwGetTime();
+
+    if (slot->fence)
+    {
+        while (glClientWaitSync(slot->fence,
+                                GL_SYNC_FLUSH_COMMANDS_BIT,
+                                100000000) == GL_TIMEOUT_EXPIRED)
+        {
+            // Keep waiting, the frame will get there
+        }
+
+        glDeleteSync(slot->fence);
+        slot->fence = NULL;
+    }
+
+    if (slot->buffer)
+    {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, slot->buffer);
+        source = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+    }
+    else
+        source = slot->pixels;
+
+    if (source)
+        memcpy(job->pixels, source, width * height * 4);
+    else
+        memset(job->pixels, 0, width * height * 4);
+
+    if (slot->buffer)
+    {
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+
+    slot->pending = GLFW_FALSE;
+
+    mtx_lock(&pipeline.lock);
+    job->index = slot->index;
+    job->queued = glfwGetTime();
+    job->state = JOB_QUEUED;
+    record_stage(STAGE_READBACK, job->queued - start);
+    mtx_unlock(&pipeline.lock);
+    // Owners in write_png wait on this too, so a signal could wake one of
+    // them instead of an idle encoder
+    cnd_broadcast(&pipeline.queued);
+}
+
+int main(int argc, char** argv)
 {
     GLFWwindow* window;
     GLuint vertex_buffer, vertex_shader, fragment_shader, program;
     GLint mvp_location, vpos_location, vcol_location;
     float ratio;
-    int width, height;
-    mat4x4 mvp;
-    char* buffer;
+    int ch, i, j, frame_count = 1, encoder_count = 2;
+    int rows_per_strip;
+    int use_buffers, use_fences;
+    double start, elapsed;
+    mat4x4 p, mvp;
+    Slot slots[RING_SIZE];
+    thrd_t encoders[MAX_ENCODERS];
+
+    while ((ch = getopt(argc, argv, "c:f:hj:n:o:")) != -1)
+    {
+        switch (ch)
+        {
+            case 'c':
+                level = atoi(optarg);
+                break;
+            case 'f':
+                for (format = 0;  format < FORMAT_COUNT;  format++)
+                {
+                    if (strcmp(optarg, format_names[format]) == 0)
+                        break;
+                }
+                if (format == FORMAT_COUNT)
+                {
+                    usage();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'h':
+                usage();
+                exit(EXIT_SUCCESS);
+            case 'j':
+                encoder_count = atoi(optarg);
+                break;
+            case 'n':
+                frame_count = atoi(optarg);
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            default:
+                usage();
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (frame_count < 1)
+        frame_count = 1;
+    if (encoder_count < 1)
+        encoder_count = 1;
+    if (encoder_count > MAX_ENCODERS)
+        encoder_count = MAX_ENCODERS;
+    if (level < 0)
+        level = 0;
+    if (level > 9)
+        level = 9;
+    if (!output)
+    {
+        static char pattern[32];
+        snprintf(pattern, sizeof(pattern),
+                 frame_count == 1 ? "offscreen.%s" : "offscreen%%04d.%s",
+                 format_names[format]);
+        output = pattern;
+    }
+    else
+    {
+        // The pattern is the format string of every file name, so it must
+        // take the frame number and nothing else
+        const int conversions = count_conversions(output);
+        if (conversions < 0 || conversions > 1 ||
+            (conversions == 0 && frame_count > 1))
+        {
+            fprintf(stderr, "Output pattern needs one integer conversion, like offscreen%%04d.png\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    init_tables();
 
     glfwSetErrorCallback(error_callback);
 
@@ -141,33 +1248,189 @@ int main(void)
     ratio = width / (float) height;
 
     glViewport(0, 0, width, height);
-    glClear(GL_COLOR_BUFFER_BIT);
-
-    mat4x4_ortho(mvp, -ratio, ratio, -1.f, 1.f, 1.f, -1.f);
-
     glUseProgram(program);
-    glUniformMatrix4fv(mvp_location, 1, GL_FALSE, (const GLfloat*) mvp);
-    glDrawArrays(GL_TRIANGLES, 0, 3);
-    glFinish();
 
+    mat4x4_ortho(p, -ratio, ratio, -1.f, 1.f, 1.f, -1.f);
+
+    // Pixel buffer objects let glReadPixels return before the frame is done,
+    // and fences tell us when it is without stalling on the newest frame
 #if USE_NATIVE_OSMESA
-    glfwGetOSMesaColorBuffer(window, &width, &height, NULL, (void**) &buffer);
+    use_buffers = GLFW_FALSE;
 #else
-    buffer = calloc(4, width * height);
-    glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, buffer);
+    use_buffers = GLAD_GL_VERSION_2_1;
 #endif
+    use_fences = use_buffers && GLAD_GL_VERSION_3_2;
+
+    memset(slots, 0, sizeof(slots));
+    for (i = 0;  i < RING_SIZE;  i++)
+    {
+        if (use_buffers)
+        {
+            glGenBuffers(1, &slots[i].buffer);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, slots[i].buffer);
+            glBufferData(GL_PIXEL_PACK_BUFFER, width * height * 4, NULL, GL_STREAM_READ);
+        }
+        else
+            slots[i].pixels = calloc(4, width * height);
+    }
+
+    if (use_buffers)
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    // One job per encoder plus one being filled keeps every encoder busy
+    mtx_init(&pipeline.lock, mtx_plain);
+    cnd_init(&pipeline.queued);
+    cnd_init(&pipeline.released);
+    pipeline.job_count = encoder_count + 1;
+    pipeline.jobs = calloc(pipeline.job_count, sizeof(Job));
+
+    rows_per_strip = STRIP_BYTES / (1 + width * 4) + 1;
+    strip_count = (height + rows_per_strip - 1) / rows_per_strip;
+    zero_row = calloc(4, width);
+
+    for (i = 0;  i < pipeline.job_count;  i++)
+    {
+        Job* job = pipeline.jobs + i;
+
+        job->pixels = calloc(4, width * height);
+        job->strips = calloc(strip_count, sizeof(Strip));
+
+        for (j = 0;  j < strip_count;  j++)
+        {
+            Strip* strip = job->strips + j;
+            size_t size;
+
+            strip->first = j * rows_per_strip;
+            strip->count = height - strip->first < rows_per_strip
+                         ? height - strip->first : rows_per_strip;
+            strip->last = j == strip_count - 1;
+
+            // Fixed codes take at most nine bits a byte, stored blocks five
+            // bytes of header per 64 KiB, plus the flush and some slack
+            size = (size_t) strip->count * (1 + width * 4);
+            strip->filtered = malloc(size);
+            strip->scratch = malloc(1 + width * 4);
+            strip->data = malloc(size + size / 8 + 64);
+        }
+    }
+
+    for (i = 0;  i < encoder_count;  i++)
+    {
+        if (thrd_create(&encoders[i], encoder_main, NULL) != thrd_success)
+        {
+            fprintf(stderr, "Failed to create encoder thread\n");
+            glfwTerminate();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    start = glfwGetTime();
+
+    for (i = 0;  i < frame_count + RING_SIZE;  i++)
+    {
+        Slot* slot = slots + i % RING_SIZE;
+        double frame_start;
+        mat4x4 m;
 
-    // Write image Y-flipped because OpenGL
-    stbi_write_png("offscreen.png",
-                   width, height, 4,
-                   buffer + (width * 4 * (height - 1)),
-                   -width * 4);
+        // The oldest frame in the ring has had the longest to finish
+        if (slot->pending)
+            retire_slot(slot);
 
+        if (i >= frame_count)
+            continue;
+
+        frame_start = glfwGetTime();
+
+        mat4x4_identity(m);
+        mat4x4_rotate_Z(m, m, i * 0.05f);
+        mat4x4_mul(mvp, p, m);
+
+        glClear(GL_COLOR_BUFFER_BIT);
+        glUniformMatrix4fv(mvp_location, 1, GL_FALSE, (const GLfloat*) mvp);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+
+        if (slot->buffer)
+        {
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, slot->buffer);
+            glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+            if (use_fences)
+                slot->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        }
+        else
+        {
 #if USE_NATIVE_OSMESA
-    // Here is where there's nothing
+            char* buffer;
+            glFinish();
+            glfwGetOSMesaColorBuffer(window, &width, &height, NULL, (void**) &buffer);
+            memcpy(slot->pixels, buffer, width * height * 4);
 #else
-    free(buffer);
+            glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, slot->pixels);
 #endif
+        }
+
+        slot->index = i;
+        slot->pending = GLFW_TRUE;
+        slot->rendered = glfwGetTime();
+
+        mtx_lock(&pipeline.lock);
+        record_stage(STAGE_RENDER, slot->rendered - frame_start);
+        mtx_unlock(&pipeline.lock);
+    }
+
+    mtx_lock(&pipeline.lock);
+    pipeline.finished = GLFW_TRUE;
+    mtx_unlock(&pipeline.lock);
+    cnd_broadcast(&pipeline.queued);
+
+    for (i = 0;  i < encoder_count;  i++)
+        thrd_join(encoders[i], NULL);
+
+    elapsed = glfwGetTime() - start;
+
+    printf("%i frames in %.3f s, %.1f frames/s (%s readback, %i encoders)\n",
+           frame_count, elapsed, frame_count / elapsed,
+           use_fences ? "fenced async" : use_buffers ? "async" : "blocking",
+           encoder_count);
+    printf("%s level %i, %.0f bytes per frame, %.1f%% of raw\n",
+           format_names[format], level, pipeline.bytes / frame_count,
+           100.0 * pipeline.bytes / frame_count / (width * height * 4.0));
+    printf("%-10s %10s %10s\n", "stage", "avg ms", "max ms");
+    for (i = 0;  i < STAGE_COUNT;  i++)
+    {
+        const int count = pipeline.stage_count[i] ? pipeline.stage_count[i] : 1;
+        printf("%-10s %10.3f %10.3f\n",
+               stage_names[i],
+               1000.0 * pipeline.stage_total[i] / count,
+               1000.0 * pipeline.stage_max[i]);
+    }
+
+    for (i = 0;  i < pipeline.job_count;  i++)
+    {
+        for (j = 0;  j < strip_count;  j++)
+        {
+            free(pipeline.jobs[i].strips[j].filtered);
+            free(pipeline.jobs[i].strips[j].scratch);
+            free(pipeline.jobs[i].strips[j].data);
+        }
+
+        free(pipeline.jobs[i].strips);
+        free(pipeline.jobs[i].pixels);
+    }
+    free(pipeline.jobs);
+    free(zero_row);
+
+    for (i = 0;  i < RING_SIZE;  i++)
+    {
+        if (slots[i].buffer)
+            glDeleteBuffers(1, &slots[i].buffer);
+        free(slots[i].pixels);
+    }
+
+    cnd_destroy(&pipeline.queued);
+    cnd_destroy(&pipeline.released);
+    mtx_destroy(&pipeline.lock);
 
     glfwDestroyWindow(window);
 
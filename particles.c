@@ -32,6 +32,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
 #include <math.h>
 #include <time.h>
 
@@ -39,10 +40,37 @@
 #include <getopt.h>
 #include <linmath.h>
 
+#if defined(_WIN32)
+ #define WIN32_LEAN_AND_MEAN
+ #include <windows.h>
+#else
+ #include <unistd.h>
+#endif
+
+// Atomic exchange and load for the snapshot handoff between threads
+#if defined(_MSC_VER)
+ #include <intrin.h>
+ #define exchange_int(p, v) _InterlockedExchange((volatile long*) (p), (v))
+ #define load_int(p) _InterlockedOr((volatile long*) (p), 0)
+#else
+ #define exchange_int(p, v) __atomic_exchange_n((p), (v), __ATOMIC_ACQ_REL)
+ #define load_int(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#endif
+
 #include <glad/gl.h>
 #define GLFW_INCLUDE_NONE
 #include <GLFW/glfw3.h>
 
+// The physics kernel runs on eight particles at a time with AVX, or as two
+// halves of four with SSE2, falling back to plain C elsewhere
+#if defined(__AVX__)
+ #include <immintrin.h>
+ #define PARTICLES_AVX
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+ #include <emmintrin.h>
+ #define PARTICLES_SSE2
+#endif
+
 // Define tokens for GL_EXT_separate_specular_color if not already defined
 #ifndef GL_EXT_separate_specular_color
 #define GL_LIGHT_MODEL_COLOR_CONTROL_EXT  0x81F8
@@ -85,15 +113,29 @@ float aspect_ratio;
 // "wireframe" flag (true if we use wireframe view)
 int wireframe;
 
-// Thread synchronization
+// What the draw thread needs of one physics step: the live particles and
+// the fountain glow
+typedef struct
+{
+    Vec3*     pos;        // Particle positions
+    GLuint*   rgba;       // Particle colors with alpha from their life
+    int       count;      // Number of particles
+    float     glow_color[4];
+    float     glow_pos[4];
+} Snapshot;
+
+// Thread synchronization: a lock-free triple buffer of snapshots. The
+// physics thread fills its back snapshot and swaps it with the middle one,
+// marking it fresh. The draw thread swaps its front snapshot with the
+// middle one when that is fresh. Each side only ever waits on its own
+// work, and the draw thread always has the latest complete step.
+#define SNAPSHOT_FRESH 4
+
 struct {
-    double    t;         // Time (s)
-    float     dt;        // Time since last frame (s)
-    int       p_frame;   // Particle physics frame number
-    int       d_frame;   // Particle draw frame number
-    cnd_t     p_done;    // Condition: particle physics done
-    cnd_t     d_done;    // Condition: particle draw done
-    mtx_t     particles_lock; // Particles data sharing mutex
+    Snapshot  snapshots[3];
+    int       front;      // Being drawn, owned by the draw thread
+    int       middle;     // Last one handed over, plus SNAPSHOT_FRESH if new
+    int       back;       // Being filled, owned by the physics thread
 } thread_sync;
 
 
@@ -148,14 +190,14 @@ const unsigned char floor_texture[ F_TEX_WIDTH * F_TEX_HEIGHT ] = {
 // modular world, these values should be variables...
 //========================================================================
 
-// Maximum number of particles
+// Default maximum number of particles (see the -n option)
 #define MAX_PARTICLES   3000
 
 // Life span of a particle (in seconds)
 #define LIFE_SPAN       8.f
 
 // A new particle is born every [BIRTH_INTERVAL] second
-#define BIRTH_INTERVAL (LIFE_SPAN/(float)MAX_PARTICLES)
+#define BIRTH_INTERVAL (LIFE_SPAN/(float)max_particles)
 
 // Particle size (meters)
 #define PARTICLE_SIZE   0.7f
@@ -175,26 +217,72 @@ const unsigned char floor_texture[ F_TEX_WIDTH * F_TEX_HEIGHT ] = {
 // Fountain radius (m)
 #define FOUNTAIN_RADIUS 1.6f
 
-// Minimum delta-time for particle phisics (s)
-#define MIN_DELTA_T     (BIRTH_INTERVAL * 0.5f)
+// Minimum delta-time for particle phisics (s), kept from shrinking with the
+// birth interval at large particle counts
+#define MIN_DELTA_T     (BIRTH_INTERVAL * 0.5f > 0.001f ? BIRTH_INTERVAL * 0.5f : 0.001f)
 
 
 //========================================================================
 // Particle system global variables
 //========================================================================
 
-// This structure holds all state for a single particle
-typedef struct {
-    float x,y,z;     // Position in space
-    float vx,vy,vz;  // Velocity vector
-    float r,g,b;     // Color of particle
-    float life;      // Life of particle (1.0 = newborn, < 0.0 = dead)
-    int   active;    // Tells if this particle is active
-} PARTICLE;
-
-// Global vectors holding all particles. We use two vectors for double
-// buffering.
-static PARTICLE particles[MAX_PARTICLES];
+// All particle state, one array per field so that the physics kernel can
+// load eight particles of a field at a time. The capacity is rounded up to
+// a multiple of eight.
+//
+// Every particle lives exactly LIFE_SPAN seconds, so they die in the order
+// they were born and the arrays are used as a ring: particles are born at
+// the end of the live run and die off its start, both in constant time,
+// and the live run is at most two contiguous pieces. Slots outside it are
+// dead.
+static struct {
+    float*  x;        // Position in space
+    float*  y;
+    float*  z;
+    float*  vx;       // Velocity vector
+    float*  vy;
+    float*  vz;
+    GLuint* rgba;     // Color of particle (alpha is set when drawing)
+    float*  life;     // Life of particle (1.0 = newborn, <= 0.0 = dead)
+    int     capacity;
+    int     first;    // Oldest live particle
+    int     count;    // Number of live particles
+} particles;
+
+// Maximum number of particles alive at once
+static int max_particles = MAX_PARTICLES;
+
+// Maximum number of physics workers (see the -j option)
+#define MAX_WORKERS     64
+
+// Particles per unit of physics work, a multiple of eight
+#define PHYSICS_CHUNK   4096
+
+// Pool of physics workers. The physics thread posts one step at a time and
+// works on it as worker zero. The live run is cut into chunks and each
+// worker starts on its own share of them. A worker that runs out steals
+// half of what is left in another worker's share, so uneven progress still
+// keeps everyone busy until the step is done. Births are always handled by
+// the physics thread after the step, in the same order whatever the number
+// of workers, so the results do not depend on it.
+static struct {
+    mtx_t     lock;       // Guards the fields below, not the queues
+    cnd_t     start;      // Condition: a step was posted
+    cnd_t     done;       // Condition: the last helper finished the step
+    int       step;       // Number of steps posted so far
+    int       busy;       // Helpers still working on the current step
+    int       quit;       // Tells the helpers to exit
+    int       count;      // Number of workers, the physics thread included
+    float     dt;         // Delta time of the current step
+    int       pieces[2][2]; // Live run as [first, last) pieces of the ring
+    int       chunks[2];  // Number of chunks in each piece
+    thrd_t    threads[MAX_WORKERS];
+    struct {
+        mtx_t lock;
+        int   begin, end; // Chunks not yet taken; owner takes from begin,
+                          // thieves from end
+    } queues[MAX_WORKERS];
+} workers;
 
 // Global variable holding the age of the youngest particle
 static float min_age;
@@ -205,6 +293,31 @@ static float glow_color[4];
 // Position of latest born particle (used for fountain lighting)
 static float glow_pos[4];
 
+// Floats of state per particle on the GPU: position, velocity and life
+#define GPU_STATE_FLOATS 7
+
+// GPU particle engine (see the -g option). The particle state lives in two
+// buffer objects and each step is a transform feedback pass from one into
+// the other, so only births are ever uploaded. The slots are used as a ring
+// like the particle arrays above: births are made and aged on the CPU in
+// the particle arrays, which then only need room for one step's worth,
+// and are written over the oldest slots.
+static struct {
+    int       enabled;
+    GLuint    state[2];       // Particle state, read and written in turns
+    GLuint    colors;         // Packed particle colors, written at birth
+    int       current;        // State buffer holding the latest step
+    int       next;           // Slot for the next birth
+    int       births;         // Births waiting in the particle arrays
+    float*    staging;        // Births interleaved for upload
+    double    t_old;          // Time of the latest step
+    GLuint    update_program;
+    GLuint    draw_program;
+    GLint     dt_location;
+    GLint     point_scale_location;
+    GLint     textured_location;
+} gpu;
+
 
 //========================================================================
 // Object material and fog configuration constants
@@ -225,10 +338,13 @@ const GLfloat fog_color[4]         = { 0.1f, 0.1f, 0.1f, 1.f };
 
 static void usage(void)
 {
-    printf("Usage: particles [-bfhs]\n");
+    printf("Usage: particles [-bfghs] [-j WORKERS] [-n COUNT]\n");
     printf("Options:\n");
     printf(" -f   Run in full screen\n");
+    printf(" -g   Run the particle physics on the GPU (needs OpenGL 3.0)\n");
     printf(" -h   Display this help\n");
+    printf(" -j   Number of physics worker threads (default is one per core)\n");
+    printf(" -n   Maximum number of particles (default %i)\n", MAX_PARTICLES);
     printf(" -s   Run program as single thread (default is to use two threads)\n");
     printf("\n");
     printf("Program runtime controls:\n");
@@ -241,47 +357,55 @@ static void usage(void)
 // Initialize a new particle
 //========================================================================
 
-static void init_particle(PARTICLE *p, double t)
+static void init_particle(int i, double t)
 {
-    float xy_angle, velocity;
+    float xy_angle, velocity, vx, vy, vz, r, g, b;
+    GLuint rgba;
 
     // Start position of particle is at the fountain blow-out
-    p->x = 0.f;
-    p->y = 0.f;
-    p->z = FOUNTAIN_HEIGHT;
+    particles.x[i] = 0.f;
+    particles.y[i] = 0.f;
+    particles.z[i] = FOUNTAIN_HEIGHT;
 
     // Start velocity is up (Z)...
-    p->vz = 0.7f + (0.3f / 4096.f) * (float) (rand() & 4095);
+    vz = 0.7f + (0.3f / 4096.f) * (float) (rand() & 4095);
 
     // ...and a randomly chosen X/Y direction
     xy_angle = (2.f * (float) M_PI / 4096.f) * (float) (rand() & 4095);
-    p->vx = 0.4f * (float) cos(xy_angle);
-    p->vy = 0.4f * (float) sin(xy_angle);
+    vx = 0.4f * (float) cos(xy_angle);
+    vy = 0.4f * (float) sin(xy_angle);
 
     // Scale velocity vector according to a time-varying velocity
     velocity = VELOCITY * (0.8f + 0.1f * (float) (sin(0.5 * t) + sin(1.31 * t)));
-    p->vx *= velocity;
-    p->vy *= velocity;
-    p->vz *= velocity;
+    particles.vx[i] = vx * velocity;
+    particles.vy[i] = vy * velocity;
+    particles.vz[i] = vz * velocity;
 
     // Color is time-varying
-    p->r = 0.7f + 0.3f * (float) sin(0.34 * t + 0.1);
-    p->g = 0.6f + 0.4f * (float) sin(0.63 * t + 1.1);
-    p->b = 0.6f + 0.4f * (float) sin(0.91 * t + 2.1);
+    r = 0.7f + 0.3f * (float) sin(0.34 * t + 0.1);
+    g = 0.6f + 0.4f * (float) sin(0.63 * t + 1.1);
+    b = 0.6f + 0.4f * (float) sin(0.91 * t + 2.1);
+
+    // Convert color from float to 8-bit (store it in a 32-bit integer using
+    // endian independent type casting)
+    ((GLubyte*) &rgba)[0] = (GLubyte)(r * 255.f);
+    ((GLubyte*) &rgba)[1] = (GLubyte)(g * 255.f);
+    ((GLubyte*) &rgba)[2] = (GLubyte)(b * 255.f);
+    ((GLubyte*) &rgba)[3] = 0;
+    particles.rgba[i] = rgba;
 
     // Store settings for fountain glow lighting
     glow_pos[0] = 0.4f * (float) sin(1.34 * t);
     glow_pos[1] = 0.4f * (float) sin(3.11 * t);
     glow_pos[2] = FOUNTAIN_HEIGHT + 1.f;
     glow_pos[3] = 1.f;
-    glow_color[0] = p->r;
-    glow_color[1] = p->g;
-    glow_color[2] = p->b;
+    glow_color[0] = r;
+    glow_color[1] = g;
+    glow_color[2] = b;
     glow_color[3] = 1.f;
 
-    // The particle is new-born and active
-    p->life = 1.f;
-    p->active = 1;
+    // The particle is new-born
+    particles.life[i] = 1.f;
 }
 
 
@@ -291,51 +415,345 @@ static void init_particle(PARTICLE *p, double t)
 
 #define FOUNTAIN_R2 (FOUNTAIN_RADIUS+PARTICLE_SIZE/2)*(FOUNTAIN_RADIUS+PARTICLE_SIZE/2)
 
-static void update_particle(PARTICLE *p, float dt)
+// A living particle ages, falls and moves. If it is falling into the top of
+// the fountain or the floor, it bounces off with friction. A dead particle,
+// or one that dies in this step, keeps its place.
+//
+// Each update is written as selects between the moved and unmoved state so
+// that it maps directly onto the SIMD kernel below and matches it exactly.
+static void update_particle(int i, float dt)
 {
-    // If the particle is not active, we need not do anything
-    if (!p->active)
-        return;
+    const float life = particles.life[i] - dt * (1.f / LIFE_SPAN);
+    const int alive = particles.life[i] > 0.f;
+    const int live = alive && life > 0.f;
+    const float vz = particles.vz[i] - GRAVITY * dt;
+    const float x = particles.x[i] + particles.vx[i] * dt;
+    const float y = particles.y[i] + particles.vy[i] * dt;
+    const float z = particles.z[i] + vz * dt;
+    const int falling = vz < 0.f;
+    const int on_fountain = falling && x * x + y * y < FOUNTAIN_R2 &&
+                            z < FOUNTAIN_HEIGHT + PARTICLE_SIZE / 2;
+    const int on_floor = falling && !on_fountain && z < PARTICLE_SIZE / 2;
+    const float h = on_fountain ? FOUNTAIN_HEIGHT + PARTICLE_SIZE / 2 : PARTICLE_SIZE / 2;
+    const int bounce = on_fountain || on_floor;
+
+    particles.life[i] = alive ? life : particles.life[i];
+    if (live)
+    {
+        particles.x[i] = x;
+        particles.y[i] = y;
+        particles.z[i] = bounce ? h + FRICTION * (h - z) : z;
+        particles.vz[i] = bounce ? -FRICTION * vz : vz;
+    }
+}
 
-    // The particle is getting older...
-    p->life -= dt * (1.f / LIFE_SPAN);
+#if defined(PARTICLES_AVX)
+
+typedef __m256 lanes;
+#define LANE_COUNT 8
+#define lanes_set   _mm256_set1_ps
+#define lanes_load  _mm256_loadu_ps
+#define lanes_store _mm256_storeu_ps
+#define lanes_add   _mm256_add_ps
+#define lanes_sub   _mm256_sub_ps
+#define lanes_mul   _mm256_mul_ps
+#define lanes_and   _mm256_and_ps
+#define lanes_andnot _mm256_andnot_ps
+#define lanes_or    _mm256_or_ps
+#define lanes_lt(a, b) _mm256_cmp_ps((a), (b), _CMP_LT_OQ)
+#define lanes_select(mask, a, b) _mm256_blendv_ps((b), (a), (mask))
+
+#elif defined(PARTICLES_SSE2)
+
+typedef __m128 lanes;
+#define LANE_COUNT 4
+#define lanes_set   _mm_set1_ps
+#define lanes_load  _mm_loadu_ps
+#define lanes_store _mm_storeu_ps
+#define lanes_add   _mm_add_ps
+#define lanes_sub   _mm_sub_ps
+#define lanes_mul   _mm_mul_ps
+#define lanes_and   _mm_and_ps
+#define lanes_andnot _mm_andnot_ps
+#define lanes_or    _mm_or_ps
+#define lanes_lt    _mm_cmplt_ps
+#define lanes_select(mask, a, b) \
+    _mm_or_ps(_mm_and_ps((mask), (a)), _mm_andnot_ps((mask), (b)))
 
-    // Did the particle die?
-    if (p->life <= 0.f)
+#endif
+
+// Updates particles [first, last) where both are multiples of eight
+static void update_particles(int first, int last, float dt)
+{
+    int i;
+#if defined(LANE_COUNT)
+    const lanes zero = lanes_set(0.f);
+    const lanes step = lanes_set(dt);
+    const lanes aging = lanes_set(dt * (1.f / LIFE_SPAN));
+    const lanes fall = lanes_set(GRAVITY * dt);
+    const lanes radius2 = lanes_set(FOUNTAIN_R2);
+    const lanes fountain_h = lanes_set(FOUNTAIN_HEIGHT + PARTICLE_SIZE / 2);
+    const lanes floor_h = lanes_set(PARTICLE_SIZE / 2);
+    const lanes friction = lanes_set(FRICTION);
+    const lanes neg_friction = lanes_set(-FRICTION);
+
+    for (i = first;  i < last;  i += LANE_COUNT)
     {
-        p->active = 0;
-        return;
+        const lanes life0 = lanes_load(particles.life + i);
+        const lanes x0 = lanes_load(particles.x + i);
+        const lanes y0 = lanes_load(particles.y + i);
+        const lanes z0 = lanes_load(particles.z + i);
+        const lanes vz0 = lanes_load(particles.vz + i);
+        const lanes life = lanes_sub(life0, aging);
+        const lanes alive = lanes_lt(zero, life0);
+        const lanes live = lanes_and(alive, lanes_lt(zero, life));
+        const lanes vz = lanes_sub(vz0, fall);
+        const lanes x = lanes_add(x0, lanes_mul(lanes_load(particles.vx + i), step));
+        const lanes y = lanes_add(y0, lanes_mul(lanes_load(particles.vy + i), step));
+        const lanes z = lanes_add(z0, lanes_mul(vz, step));
+        const lanes falling = lanes_lt(vz, zero);
+        const lanes on_fountain =
+            lanes_and(falling,
+                      lanes_and(lanes_lt(lanes_add(lanes_mul(x, x), lanes_mul(y, y)), radius2),
+                                lanes_lt(z, fountain_h)));
+        const lanes on_floor = lanes_andnot(on_fountain, lanes_and(falling, lanes_lt(z, floor_h)));
+        const lanes bounce = lanes_or(on_fountain, on_floor);
+        const lanes h = lanes_select(on_fountain, fountain_h, floor_h);
+        const lanes bz = lanes_select(bounce, lanes_add(h, lanes_mul(friction, lanes_sub(h, z))), z);
+        const lanes bvz = lanes_select(bounce, lanes_mul(neg_friction, vz), vz);
+
+        lanes_store(particles.life + i, lanes_select(alive, life, life0));
+        lanes_store(particles.x + i, lanes_select(live, x, x0));
+        lanes_store(particles.y + i, lanes_select(live, y, y0));
+        lanes_store(particles.z + i, lanes_select(live, bz, z0));
+        lanes_store(particles.vz + i, lanes_select(live, bvz, vz0));
     }
+#else
+    for (i = first;  i < last;  i++)
+        update_particle(i, dt);
+#endif
+}
 
-    // Apply gravity
-    p->vz = p->vz - GRAVITY * dt;
 
-    // Update particle position
-    p->x = p->x + p->vx * dt;
-    p->y = p->y + p->vy * dt;
-    p->z = p->z + p->vz * dt;
+//========================================================================
+// Parallel update of the live particles
+//========================================================================
 
-    // Simple collision detection + response
-    if (p->vz < 0.f)
+static int count_cores(void)
+{
+#if defined(_WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int) info.dwNumberOfProcessors;
+#else
+    return (int) sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+}
+
+static void update_chunk(int chunk)
+{
+    int piece = 0, first, last;
+
+    if (chunk >= workers.chunks[0])
     {
-        // Particles should bounce on the fountain (with friction)
-        if ((p->x * p->x + p->y * p->y) < FOUNTAIN_R2 &&
-            p->z < (FOUNTAIN_HEIGHT + PARTICLE_SIZE / 2))
+        chunk -= workers.chunks[0];
+        piece = 1;
+    }
+
+    first = workers.pieces[piece][0] + chunk * PHYSICS_CHUNK;
+    last = first + PHYSICS_CHUNK;
+    if (last > workers.pieces[piece][1])
+        last = workers.pieces[piece][1];
+
+    update_particles(first, last, workers.dt);
+}
+
+// Takes the next chunk from the worker's own share, or steals half of
+// another worker's remaining share, returning -1 when all are taken
+static int take_chunk(int worker)
+{
+    int i, chunk = -1;
+
+    mtx_lock(&workers.queues[worker].lock);
+    if (workers.queues[worker].begin < workers.queues[worker].end)
+        chunk = workers.queues[worker].begin++;
+    mtx_unlock(&workers.queues[worker].lock);
+
+    for (i = 1;  chunk < 0 && i < workers.count;  i++)
+    {
+        const int victim = (worker + i) % workers.count;
+        int begin = 0, end = 0;
+
+        mtx_lock(&workers.queues[victim].lock);
+        if (workers.queues[victim].begin < workers.queues[victim].end)
         {
-            p->vz = -FRICTION * p->vz;
-            p->z  = FOUNTAIN_HEIGHT + PARTICLE_SIZE / 2 +
-                    FRICTION * (FOUNTAIN_HEIGHT +
-                    PARTICLE_SIZE / 2 - p->z);
+            end = workers.queues[victim].end;
+            begin = end - (end - workers.queues[victim].begin + 1) / 2;
+            workers.queues[victim].end = begin;
         }
+        mtx_unlock(&workers.queues[victim].lock);
 
-        // Particles should bounce on the floor (with friction)
-        else if (p->z < PARTICLE_SIZE / 2)
+        if (begin < end)
         {
-            p->vz = -FRICTION * p->vz;
-            p->z  = PARTICLE_SIZE / 2 +
-                    FRICTION * (PARTICLE_SIZE / 2 - p->z);
+            chunk = begin;
+
+            // Keep the rest where other thieves can find it
+            mtx_lock(&workers.queues[worker].lock);
+            workers.queues[worker].begin = begin + 1;
+            workers.queues[worker].end = end;
+            mtx_unlock(&workers.queues[worker].lock);
         }
     }
+
+    return chunk;
+}
+
+static void work_on_step(int worker)
+{
+    int chunk;
+
+    while ((chunk = take_chunk(worker)) >= 0)
+        update_chunk(chunk);
+}
+
+static int worker_thread_main(void* arg)
+{
+    const int worker = (int) (intptr_t) arg;
+    int step = 0;
+
+    mtx_lock(&workers.lock);
+
+    for (;;)
+    {
+        while (!workers.quit && workers.step == step)
+            cnd_wait(&workers.start, &workers.lock);
+
+        if (workers.quit)
+            break;
+
+        step = workers.step;
+        mtx_unlock(&workers.lock);
+
+        work_on_step(worker);
+
+        mtx_lock(&workers.lock);
+        if (--workers.busy == 0)
+            cnd_signal(&workers.done);
+    }
+
+    mtx_unlock(&workers.lock);
+    return 0;
+}
+
+// Starts the helper threads, falling back to fewer if some fail to start
+static void start_workers(int count)
+{
+    int i;
+
+    if (count < 1)
+        count = count_cores();
+    if (count < 1)
+        count = 1;
+    if (count > MAX_WORKERS)
+        count = MAX_WORKERS;
+
+    mtx_init(&workers.lock, mtx_plain);
+    cnd_init(&workers.start);
+    cnd_init(&workers.done);
+
+    for (i = 0;  i < count;  i++)
+        mtx_init(&workers.queues[i].lock, mtx_plain);
+
+    workers.count = 1;
+
+    for (i = 1;  i < count;  i++)
+    {
+        if (thrd_create(&workers.threads[i], worker_thread_main,
+                        (void*) (intptr_t) i) != thrd_success)
+        {
+            break;
+        }
+
+        workers.count++;
+    }
+}
+
+static void stop_workers(void)
+{
+    int i;
+
+    mtx_lock(&workers.lock);
+    workers.quit = 1;
+    mtx_unlock(&workers.lock);
+    cnd_broadcast(&workers.start);
+
+    for (i = 1;  i < workers.count;  i++)
+        thrd_join(workers.threads[i], NULL);
+}
+
+// Updates the live run, widened to multiples of eight, or the whole ring if
+// the widened pieces of a wrapped run would overlap
+static void update_live_particles(float dt)
+{
+    int i, piece_count = 1, chunk_count = 0;
+    const int end = particles.first + particles.count;
+
+    if (end <= particles.capacity)
+    {
+        workers.pieces[0][0] = particles.first & ~7;
+        workers.pieces[0][1] = (end + 7) & ~7;
+    }
+    else if (((end - particles.capacity + 7) & ~7) > (particles.first & ~7))
+    {
+        workers.pieces[0][0] = 0;
+        workers.pieces[0][1] = particles.capacity;
+    }
+    else
+    {
+        workers.pieces[0][0] = particles.first & ~7;
+        workers.pieces[0][1] = particles.capacity;
+        workers.pieces[1][0] = 0;
+        workers.pieces[1][1] = (end - particles.capacity + 7) & ~7;
+        piece_count = 2;
+    }
+
+    workers.chunks[1] = 0;
+    for (i = 0;  i < piece_count;  i++)
+    {
+        const int size = workers.pieces[i][1] - workers.pieces[i][0];
+        workers.chunks[i] = (size + PHYSICS_CHUNK - 1) / PHYSICS_CHUNK;
+        chunk_count += workers.chunks[i];
+    }
+
+    workers.dt = dt;
+
+    // Not worth waking anyone for
+    if (workers.count == 1 || chunk_count < 2)
+    {
+        for (i = 0;  i < chunk_count;  i++)
+            update_chunk(i);
+        return;
+    }
+
+    // The helpers are all waiting, so the queues can be set without locks
+    for (i = 0;  i < workers.count;  i++)
+    {
+        workers.queues[i].begin = chunk_count * i / workers.count;
+        workers.queues[i].end = chunk_count * (i + 1) / workers.count;
+    }
+
+    mtx_lock(&workers.lock);
+    workers.busy = workers.count - 1;
+    workers.step++;
+    mtx_unlock(&workers.lock);
+    cnd_broadcast(&workers.start);
+
+    work_on_step(0);
+
+    mtx_lock(&workers.lock);
+    while (workers.busy)
+        cnd_wait(&workers.done, &workers.lock);
+    mtx_unlock(&workers.lock);
 }
 
 
@@ -354,8 +772,15 @@ static void particle_engine(double t, float dt)
         // Calculate delta time for this iteration
         dt2 = dt < MIN_DELTA_T ? dt : MIN_DELTA_T;
 
-        for (i = 0;  i < MAX_PARTICLES;  i++)
-            update_particle(&particles[i], dt2);
+        update_live_particles(dt2);
+
+        // Retire the particles that died, oldest first
+        while (particles.count && particles.life[particles.first] <= 0.f)
+        {
+            particles.count--;
+            if (++particles.first == particles.capacity)
+                particles.first = 0;
+        }
 
         min_age += dt2;
 
@@ -364,15 +789,16 @@ static void particle_engine(double t, float dt)
         {
             min_age -= BIRTH_INTERVAL;
 
-            // Find a dead particle to replace with a new one
-            for (i = 0;  i < MAX_PARTICLES;  i++)
+            // Append a new particle to the live run, if there is room
+            if (particles.count < max_particles)
             {
-                if (!particles[i].active)
-                {
-                    init_particle(&particles[i], t + min_age);
-                    update_particle(&particles[i], min_age);
-                    break;
-                }
+                i = particles.first + particles.count;
+                if (i >= particles.capacity)
+                    i -= particles.capacity;
+
+                init_particle(i, t + min_age);
+                update_particle(i, min_age);
+                particles.count++;
             }
         }
 
@@ -381,6 +807,62 @@ static void particle_engine(double t, float dt)
 }
 
 
+//========================================================================
+// Hand the particles over to the draw thread
+//========================================================================
+
+static void publish_snapshot(void)
+{
+    int i, n;
+    float alpha;
+    GLuint rgba;
+    Snapshot* snapshot = thread_sync.snapshots + thread_sync.back;
+
+    snapshot->count = 0;
+
+    for (n = 0;  n < particles.count;  n++)
+    {
+        i = particles.first + n;
+        if (i >= particles.capacity)
+            i -= particles.capacity;
+
+        if (particles.life[i] > 0.f)
+        {
+            // Calculate particle intensity (we set it to max during 75%
+            // of its life, then it fades out)
+            alpha =  4.f * particles.life[i];
+            if (alpha > 1.f)
+                alpha = 1.f;
+
+            // The color was packed at birth, only alpha changes
+            rgba = particles.rgba[i];
+            ((GLubyte*) &rgba)[3] = (GLubyte)(alpha * 255.f);
+
+            snapshot->pos[snapshot->count].x = particles.x[i];
+            snapshot->pos[snapshot->count].y = particles.y[i];
+            snapshot->pos[snapshot->count].z = particles.z[i];
+            snapshot->rgba[snapshot->count] = rgba;
+            snapshot->count++;
+        }
+    }
+
+    memcpy(snapshot->glow_color, glow_color, sizeof(glow_color));
+    memcpy(snapshot->glow_pos, glow_pos, sizeof(glow_pos));
+
+    thread_sync.back = exchange_int(&thread_sync.middle,
+                                    thread_sync.back | SNAPSHOT_FRESH) & 3;
+}
+
+// Returns the latest complete snapshot, which stays valid until next call
+static const Snapshot* latest_snapshot(void)
+{
+    if (load_int(&thread_sync.middle) & SNAPSHOT_FRESH)
+        thread_sync.front = exchange_int(&thread_sync.middle, thread_sync.front) & 3;
+
+    return thread_sync.snapshots + thread_sync.front;
+}
+
+
 //========================================================================
 // Draw all active particles. We use OpenGL 1.1 vertex
 // arrays for this in order to accelerate the drawing.
@@ -391,16 +873,14 @@ static void particle_engine(double t, float dt)
                             // the L1 data cache on most CPUs)
 #define PARTICLE_VERTS  4   // Number of vertices per particle
 
-static void draw_particles(GLFWwindow* window, double t, float dt)
+static void draw_particles(const Snapshot* snapshot)
 {
     int i, particle_count;
     Vertex vertex_array[BATCH_PARTICLES * PARTICLE_VERTS];
     Vertex* vptr;
-    float alpha;
     GLuint rgba;
     Vec3 quad_lower_left, quad_lower_right;
     GLfloat mat[16];
-    PARTICLE* pptr;
 
     // Here comes the real trick with flat single primitive objects (s.c.
     // "billboards"): We must rotate the textured primitive so that it
@@ -451,91 +931,60 @@ static void draw_particles(GLFWwindow* window, double t, float dt)
     // Most OpenGL cards / drivers are optimized for this format.
     glInterleavedArrays(GL_T2F_C4UB_V3F, 0, vertex_array);
 
-    // Wait for particle physics thread to be done
-    mtx_lock(&thread_sync.particles_lock);
-    while (!glfwWindowShouldClose(window) &&
-            thread_sync.p_frame <= thread_sync.d_frame)
-    {
-        struct timespec ts;
-        clock_gettime(CLOCK_REALTIME, &ts);
-        ts.tv_nsec += 100 * 1000 * 1000;
-        ts.tv_sec += ts.tv_nsec / (1000 * 1000 * 1000);
-        ts.tv_nsec %= 1000 * 1000 * 1000;
-        cnd_timedwait(&thread_sync.p_done, &thread_sync.particles_lock, &ts);
-    }
-
-    // Store the frame time and delta time for the physics thread
-    thread_sync.t = t;
-    thread_sync.dt = dt;
-
-    // Update frame counter
-    thread_sync.d_frame++;
-
     // Loop through all particles and build vertex arrays.
     particle_count = 0;
     vptr = vertex_array;
-    pptr = particles;
 
-    for (i = 0;  i < MAX_PARTICLES;  i++)
+    for (i = 0;  i < snapshot->count;  i++)
     {
-        if (pptr->active)
-        {
-            // Calculate particle intensity (we set it to max during 75%
-            // of its life, then it fades out)
-            alpha =  4.f * pptr->life;
-            if (alpha > 1.f)
-                alpha = 1.f;
-
-            // Convert color from float to 8-bit (store it in a 32-bit
-            // integer using endian independent type casting)
-            ((GLubyte*) &rgba)[0] = (GLubyte)(pptr->r * 255.f);
-            ((GLubyte*) &rgba)[1] = (GLubyte)(pptr->g * 255.f);
-            ((GLubyte*) &rgba)[2] = (GLubyte)(pptr->b * 255.f);
-            ((GLubyte*) &rgba)[3] = (GLubyte)(alpha * 255.f);
-
-            // 3) Translate the quad to the correct position in modelview
-            // space and store its parameters in vertex arrays (we also
-            // store texture coord and color information for each vertex).
-
-            // Lower left corner
-            vptr->s    = 0.f;
-            vptr->t    = 0.f;
-            vptr->rgba = rgba;
-            vptr->x    = pptr->x + quad_lower_left.x;
-            vptr->y    = pptr->y + quad_lower_left.y;
-            vptr->z    = pptr->z + quad_lower_left.z;
-            vptr ++;
-
-            // Lower right corner
-            vptr->s    = 1.f;
-            vptr->t    = 0.f;
-            vptr->rgba = rgba;
-            vptr->x    = pptr->x + quad_lower_right.x;
-            vptr->y    = pptr->y + quad_lower_right.y;
-            vptr->z    = pptr->z + quad_lower_right.z;
-            vptr ++;
-
-            // Upper right corner
-            vptr->s    = 1.f;
-            vptr->t    = 1.f;
-            vptr->rgba = rgba;
-            vptr->x    = pptr->x - quad_lower_left.x;
-            vptr->y    = pptr->y - quad_lower_left.y;
-            vptr->z    = pptr->z - quad_lower_left.z;
-            vptr ++;
-
-            // Upper left corner
-            vptr->s    = 0.f;
-            vptr->t    = 1.f;
-            vptr->rgba = rgba;
-            vptr->x    = pptr->x - quad_lower_right.x;
-            vptr->y    = pptr->y - quad_lower_right.y;
-            vptr->z    = pptr->z - quad_lower_right.z;
-            vptr ++;
-
-            // Increase count of drawable particles
-            particle_count ++;
-        }
+        const float x = snapshot->pos[i].x;
+        const float y = snapshot->pos[i].y;
+        const float z = snapshot->pos[i].z;
+
+        rgba = snapshot->rgba[i];
+
+        // 3) Translate the quad to the correct position in modelview
+        // space and store its parameters in vertex arrays (we also
+        // store texture coord and color information for each vertex).
+
+        // Lower left corner
+        vptr->s    = 0.f;
+        vptr->t    = 0.f;
+        vptr->rgba = rgba;
+        vptr->x    = x + quad_lower_left.x;
+        vptr->y    = y + quad_lower_left.y;
+        vptr->z    = z + quad_lower_left.z;
+        vptr ++;
+
+        // Lower right corner
+        vptr->s    = 1.f;
+        vptr->t    = 0.f;
+        vptr->rgba = rgba;
+        vptr->x    = x + quad_lower_right.x;
+        vptr->y    = y + quad_lower_right.y;
+        vptr->z    = z + quad_lower_right.z;
+        vptr ++;
+
+        // Upper right corner
+        vptr->s    = 1.f;
+        vptr->t    = 1.f;
+        vptr->rgba = rgba;
+        vptr->x    = x - quad_lower_left.x;
+        vptr->y    = y - quad_lower_left.y;
+        vptr->z    = z - quad_lower_left.z;
+        vptr ++;
+
+        // Upper left corner
+        vptr->s    = 0.f;
+        vptr->t    = 1.f;
+        vptr->rgba = rgba;
+        vptr->x    = x - quad_lower_right.x;
+        vptr->y    = y - quad_lower_right.y;
+        vptr->z    = z - quad_lower_right.z;
+        vptr ++;
+
+        // Increase count of drawable particles
+        particle_count ++;
 
         // If we have filled up one batch of particles, draw it as a set
         // of quads using glDrawArrays.
@@ -548,15 +997,8 @@ static void draw_particles(GLFWwindow* window, double t, float dt)
             particle_count = 0;
             vptr = vertex_array;
         }
-
-        // Next particle
-        pptr++;
     }
 
-    // We are done with the particle data
-    mtx_unlock(&thread_sync.particles_lock);
-    cnd_signal(&thread_sync.d_done);
-
     // Draw final batch of particles (if any)
     glDrawArrays(GL_QUADS, 0, PARTICLE_VERTS * particle_count);
 
@@ -573,6 +1015,371 @@ static void draw_particles(GLFWwindow* window, double t, float dt)
 }
 
 
+//========================================================================
+// GPU particle engine shaders
+//========================================================================
+
+// The same step as update_particle, one particle per vertex
+static const char* update_shader_text =
+"#version 130\n"
+"uniform float dt;\n"
+"uniform float life_span;\n"
+"uniform float gravity;\n"
+"uniform float friction;\n"
+"uniform float fountain_r2;\n"
+"uniform float fountain_top;\n"
+"uniform float floor_top;\n"
+"in vec3 position;\n"
+"in vec3 velocity;\n"
+"in float life;\n"
+"out vec3 new_position;\n"
+"out vec3 new_velocity;\n"
+"out float new_life;\n"
+"void main()\n"
+"{\n"
+"    float aged = life - dt * (1.0 / life_span);\n"
+"    bool live = life > 0.0 && aged > 0.0;\n"
+"    vec3 v = vec3(velocity.xy, velocity.z - gravity * dt);\n"
+"    vec3 p = position + v * dt;\n"
+"    bool falling = v.z < 0.0;\n"
+"    bool on_fountain = falling && dot(p.xy, p.xy) < fountain_r2 &&\n"
+"                       p.z < fountain_top;\n"
+"    bool on_floor = falling && !on_fountain && p.z < floor_top;\n"
+"    float h = on_fountain ? fountain_top : floor_top;\n"
+"    if (on_fountain || on_floor)\n"
+"    {\n"
+"        p.z = h + friction * (h - p.z);\n"
+"        v.z = -friction * v.z;\n"
+"    }\n"
+"    new_position = live ? p : position;\n"
+"    new_velocity = live ? v : velocity;\n"
+"    new_life = life > 0.0 ? aged : life;\n"
+"    gl_Position = vec4(0.0);\n"
+"}\n";
+
+// Particles are drawn as point sprites of PARTICLE_SIZE in world space.
+// Dead ones are moved outside the clip volume.
+static const char* draw_vertex_shader_text =
+"#version 130\n"
+"uniform float point_scale;\n"
+"in vec3 position;\n"
+"in float life;\n"
+"in vec4 color;\n"
+"out vec4 particle_color;\n"
+"void main()\n"
+"{\n"
+"    vec4 eye = gl_ModelViewMatrix * vec4(position, 1.0);\n"
+"    gl_Position = life > 0.0 ? gl_ProjectionMatrix * eye : vec4(0.0, 0.0, 2.0, 1.0);\n"
+"    gl_PointSize = point_scale / -eye.z;\n"
+"    particle_color = vec4(color.rgb, min(4.0 * life, 1.0));\n"
+"}\n";
+
+static const char* draw_fragment_shader_text =
+"#version 130\n"
+"uniform sampler2D particle_texture;\n"
+"uniform bool textured;\n"
+"in vec4 particle_color;\n"
+"void main()\n"
+"{\n"
+"    float spot = textured ? texture(particle_texture, gl_PointCoord).r : 1.0;\n"
+"    gl_FragColor = vec4(particle_color.rgb * spot, particle_color.a);\n"
+"}\n";
+
+
+//========================================================================
+// Set up the GPU particle engine
+//========================================================================
+
+static GLuint compile_shader(GLenum type, const char* text)
+{
+    GLint status;
+    char log[1024];
+    GLuint shader = glCreateShader(type);
+
+    glShaderSource(shader, 1, &text, NULL);
+    glCompileShader(shader);
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+    if (!status)
+    {
+        glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+        fprintf(stderr, "Failed to compile particle shader: %s\n", log);
+    }
+
+    return shader;
+}
+
+static GLboolean link_program(GLuint program)
+{
+    GLint status;
+    char log[1024];
+
+    glLinkProgram(program);
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if (!status)
+    {
+        glGetProgramInfoLog(program, sizeof(log), NULL, log);
+        fprintf(stderr, "Failed to link particle shaders: %s\n", log);
+        return GL_FALSE;
+    }
+
+    return GL_TRUE;
+}
+
+// Returns GLFW_FALSE if the context cannot run the GPU engine
+static int init_gpu_engine(void)
+{
+    const char* varyings[] = { "new_position", "new_velocity", "new_life" };
+    float* zeros;
+    int i;
+
+    if (!GLAD_GL_VERSION_3_0)
+    {
+        fprintf(stderr, "GPU particles need OpenGL 3.0\n");
+        return GLFW_FALSE;
+    }
+
+    gpu.update_program = glCreateProgram();
+    glAttachShader(gpu.update_program,
+                   compile_shader(GL_VERTEX_SHADER, update_shader_text));
+    glBindAttribLocation(gpu.update_program, 0, "position");
+    glBindAttribLocation(gpu.update_program, 1, "velocity");
+    glBindAttribLocation(gpu.update_program, 2, "life");
+    glTransformFeedbackVaryings(gpu.update_program, 3, varyings,
+                                GL_INTERLEAVED_ATTRIBS);
+    if (!link_program(gpu.update_program))
+        return GLFW_FALSE;
+
+    gpu.draw_program = glCreateProgram();
+    glAttachShader(gpu.draw_program,
+                   compile_shader(GL_VERTEX_SHADER, draw_vertex_shader_text));
+    glAttachShader(gpu.draw_program,
+                   compile_shader(GL_FRAGMENT_SHADER, draw_fragment_shader_text));
+    glBindAttribLocation(gpu.draw_program, 0, "position");
+    glBindAttribLocation(gpu.draw_program, 1, "life");
+    glBindAttribLocation(gpu.draw_program, 2, "color");
+    if (!link_program(gpu.draw_program))
+        return GLFW_FALSE;
+
+    glUseProgram(gpu.update_program);
+    gpu.dt_location = glGetUniformLocation(gpu.update_program, "dt");
+    glUniform1f(glGetUniformLocation(gpu.update_program, "life_span"), LIFE_SPAN);
+    glUniform1f(glGetUniformLocation(gpu.update_program, "gravity"), GRAVITY);
+    glUniform1f(glGetUniformLocation(gpu.update_program, "friction"), FRICTION);
+    glUniform1f(glGetUniformLocation(gpu.update_program, "fountain_r2"), FOUNTAIN_R2);
+    glUniform1f(glGetUniformLocation(gpu.update_program, "fountain_top"),
+                FOUNTAIN_HEIGHT + PARTICLE_SIZE / 2);
+    glUniform1f(glGetUniformLocation(gpu.update_program, "floor_top"),
+                PARTICLE_SIZE / 2);
+
+    glUseProgram(gpu.draw_program);
+    gpu.point_scale_location = glGetUniformLocation(gpu.draw_program, "point_scale");
+    gpu.textured_location = glGetUniformLocation(gpu.draw_program, "textured");
+    glUniform1i(glGetUniformLocation(gpu.draw_program, "particle_texture"), 0);
+    glUseProgram(0);
+
+    // All slots start out dead
+    zeros = calloc(max_particles, GPU_STATE_FLOATS * sizeof(float));
+
+    glGenBuffers(2, gpu.state);
+    for (i = 0;  i < 2;  i++)
+    {
+        glBindBuffer(GL_ARRAY_BUFFER, gpu.state[i]);
+        glBufferData(GL_ARRAY_BUFFER,
+                     max_particles * GPU_STATE_FLOATS * sizeof(float),
+                     zeros, GL_DYNAMIC_COPY);
+    }
+
+    glGenBuffers(1, &gpu.colors);
+    glBindBuffer(GL_ARRAY_BUFFER, gpu.colors);
+    glBufferData(GL_ARRAY_BUFFER, max_particles * sizeof(GLuint),
+                 zeros, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    free(zeros);
+
+    gpu.enabled = GLFW_TRUE;
+    return GLFW_TRUE;
+}
+
+
+//========================================================================
+// Run the GPU particle engine
+//========================================================================
+
+// Point the update or draw attributes at the particle state
+static void bind_gpu_state(GLuint buffer, GLboolean velocity)
+{
+    const GLsizei stride = GPU_STATE_FLOATS * sizeof(float);
+
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, (void*) 0);
+    glEnableVertexAttribArray(0);
+
+    if (velocity)
+    {
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, stride,
+                              (void*) (3 * sizeof(float)));
+        glVertexAttribPointer(2, 1, GL_FLOAT, GL_FALSE, stride,
+                              (void*) (6 * sizeof(float)));
+        glEnableVertexAttribArray(2);
+    }
+    else
+    {
+        glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, stride,
+                              (void*) (6 * sizeof(float)));
+    }
+
+    glEnableVertexAttribArray(1);
+}
+
+// Write the waiting births over the oldest slots
+static void upload_births(void)
+{
+    int i, n, first, count;
+    float* s = gpu.staging;
+
+    for (i = 0;  i < gpu.births;  i++)
+    {
+        *s++ = particles.x[i];
+        *s++ = particles.y[i];
+        *s++ = particles.z[i];
+        *s++ = particles.vx[i];
+        *s++ = particles.vy[i];
+        *s++ = particles.vz[i];
+        *s++ = particles.life[i];
+    }
+
+    // The births are at most two pieces in the ring
+    for (first = 0;  first < gpu.births;  first += count)
+    {
+        count = gpu.births - first;
+        if (count > max_particles - gpu.next)
+            count = max_particles - gpu.next;
+
+        n = gpu.next;
+
+        glBindBuffer(GL_ARRAY_BUFFER, gpu.state[gpu.current]);
+        glBufferSubData(GL_ARRAY_BUFFER,
+                        n * GPU_STATE_FLOATS * sizeof(float),
+                        count * GPU_STATE_FLOATS * sizeof(float),
+                        gpu.staging + first * GPU_STATE_FLOATS);
+
+        glBindBuffer(GL_ARRAY_BUFFER, gpu.colors);
+        glBufferSubData(GL_ARRAY_BUFFER,
+                        n * sizeof(GLuint),
+                        count * sizeof(GLuint),
+                        particles.rgba + first);
+
+        gpu.next += count;
+        if (gpu.next == max_particles)
+            gpu.next = 0;
+    }
+
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    gpu.births = 0;
+}
+
+// Step every slot from the current state buffer into the other one
+static void update_gpu_particles(float dt)
+{
+    glUseProgram(gpu.update_program);
+    glUniform1f(gpu.dt_location, dt);
+
+    bind_gpu_state(gpu.state[gpu.current], GL_TRUE);
+    glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, gpu.state[!gpu.current]);
+
+    glEnable(GL_RASTERIZER_DISCARD);
+    glBeginTransformFeedback(GL_POINTS);
+    glDrawArrays(GL_POINTS, 0, max_particles);
+    glEndTransformFeedback();
+    glDisable(GL_RASTERIZER_DISCARD);
+
+    glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0);
+    glDisableVertexAttribArray(0);
+    glDisableVertexAttribArray(1);
+    glDisableVertexAttribArray(2);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glUseProgram(0);
+
+    gpu.current = !gpu.current;
+}
+
+// The GPU counterpart of particle_engine, run by the draw thread
+static void gpu_particle_engine(double t)
+{
+    float dt = (float) (t - gpu.t_old), dt2;
+
+    gpu.t_old = t;
+
+    while (dt > 0.f)
+    {
+        dt2 = dt < MIN_DELTA_T ? dt : MIN_DELTA_T;
+
+        update_gpu_particles(dt2);
+
+        min_age += dt2;
+
+        while (min_age >= BIRTH_INTERVAL)
+        {
+            min_age -= BIRTH_INTERVAL;
+
+            if (gpu.births == particles.capacity)
+                upload_births();
+
+            init_particle(gpu.births, t + min_age);
+            update_particle(gpu.births, min_age);
+            gpu.births++;
+        }
+
+        upload_births();
+
+        dt -= dt2;
+    }
+}
+
+static void draw_gpu_particles(const mat4x4 projection)
+{
+    GLint viewport[4];
+
+    glGetIntegerv(GL_VIEWPORT, viewport);
+
+    glDepthMask(GL_FALSE);
+
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE);
+
+    glEnable(GL_VERTEX_PROGRAM_POINT_SIZE);
+    glEnable(GL_POINT_SPRITE);
+    glBindTexture(GL_TEXTURE_2D, particle_tex_id);
+
+    // Points are sized in pixels, so scale by how large one unit at unit
+    // distance is in the viewport
+    glUseProgram(gpu.draw_program);
+    glUniform1f(gpu.point_scale_location,
+                PARTICLE_SIZE * projection[1][1] * viewport[3] * 0.5f);
+    glUniform1i(gpu.textured_location, !wireframe);
+
+    bind_gpu_state(gpu.state[gpu.current], GL_FALSE);
+    glBindBuffer(GL_ARRAY_BUFFER, gpu.colors);
+    glVertexAttribPointer(2, 4, GL_UNSIGNED_BYTE, GL_TRUE, 0, (void*) 0);
+    glEnableVertexAttribArray(2);
+
+    glDrawArrays(GL_POINTS, 0, max_particles);
+
+    glDisableVertexAttribArray(0);
+    glDisableVertexAttribArray(1);
+    glDisableVertexAttribArray(2);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glUseProgram(0);
+
+    glDisable(GL_POINT_SPRITE);
+    glDisable(GL_VERTEX_PROGRAM_POINT_SIZE);
+    glDisable(GL_BLEND);
+
+    glDepthMask(GL_TRUE);
+}
+
+
 //========================================================================
 // Fountain geometry specification
 //========================================================================
@@ -745,7 +1552,7 @@ static void draw_floor(void)
 // Position and configure light sources
 //========================================================================
 
-static void setup_lights(void)
+static void setup_lights(const float* l3pos, const float* l3col)
 {
     float l1pos[4], l1amb[4], l1dif[4], l1spec[4];
     float l2pos[4], l2amb[4], l2dif[4], l2spec[4];
@@ -770,9 +1577,9 @@ static void setup_lights(void)
     glLightfv(GL_LIGHT2, GL_AMBIENT, l2amb);
     glLightfv(GL_LIGHT2, GL_DIFFUSE, l2dif);
     glLightfv(GL_LIGHT2, GL_SPECULAR, l2spec);
-    glLightfv(GL_LIGHT3, GL_POSITION, glow_pos);
-    glLightfv(GL_LIGHT3, GL_DIFFUSE, glow_color);
-    glLightfv(GL_LIGHT3, GL_SPECULAR, glow_color);
+    glLightfv(GL_LIGHT3, GL_POSITION, l3pos);
+    glLightfv(GL_LIGHT3, GL_DIFFUSE, l3col);
+    glLightfv(GL_LIGHT3, GL_SPECULAR, l3col);
 
     glEnable(GL_LIGHT1);
     glEnable(GL_LIGHT2);
@@ -787,13 +1594,14 @@ static void setup_lights(void)
 static void draw_scene(GLFWwindow* window, double t)
 {
     double xpos, ypos, zpos, angle_x, angle_y, angle_z;
-    static double t_old = 0.0;
-    float dt;
     mat4x4 projection;
+    const Snapshot* snapshot = NULL;
 
-    // Calculate frame-to-frame delta time
-    dt = (float) (t - t_old);
-    t_old = t;
+    // The GPU engine steps on this thread, the CPU one hands over snapshots
+    if (gpu.enabled)
+        gpu_particle_engine(t);
+    else
+        snapshot = latest_snapshot();
 
     mat4x4_perspective(projection,
                        65.f * (float) M_PI / 180.f,
@@ -830,7 +1638,10 @@ static void draw_scene(GLFWwindow* window, double t)
     glCullFace(GL_BACK);
     glEnable(GL_CULL_FACE);
 
-    setup_lights();
+    if (gpu.enabled)
+        setup_lights(glow_pos, glow_color);
+    else
+        setup_lights(snapshot->glow_pos, snapshot->glow_color);
     glEnable(GL_LIGHTING);
 
     glEnable(GL_FOG);
@@ -850,7 +1661,10 @@ static void draw_scene(GLFWwindow* window, double t)
     glDisable(GL_FOG);
 
     // Particles must be drawn after all solid objects have been drawn
-    draw_particles(window, t, dt);
+    if (gpu.enabled)
+        draw_gpu_particles(projection);
+    else
+        draw_particles(snapshot);
 
     // Z-buffer not needed anymore
     glDisable(GL_DEPTH_TEST);
@@ -900,35 +1714,30 @@ static void key_callback(GLFWwindow* window, int key, int scancode, int action,
 static int physics_thread_main(void* arg)
 {
     GLFWwindow* window = arg;
+    double t_old = 0.0;
 
-    for (;;)
+    while (!glfwWindowShouldClose(window))
     {
-        mtx_lock(&thread_sync.particles_lock);
+        const double t = glfwGetTime();
 
-        // Wait for particle drawing to be done
-        while (!glfwWindowShouldClose(window) &&
-               thread_sync.p_frame > thread_sync.d_frame)
+        // Steps finer than the physics resolution are not worth publishing,
+        // so sleep until the next one is due
+        if (t - t_old < MIN_DELTA_T)
         {
-            struct timespec ts;
-            clock_gettime(CLOCK_REALTIME, &ts);
-            ts.tv_nsec += 100 * 1000 * 1000;
-            ts.tv_sec += ts.tv_nsec / (1000 * 1000 * 1000);
-            ts.tv_nsec %= 1000 * 1000 * 1000;
-            cnd_timedwait(&thread_sync.d_done, &thread_sync.particles_lock, &ts);
-        }
+            const double wait = MIN_DELTA_T - (t - t_old);
+            struct timespec duration;
 
-        if (glfwWindowShouldClose(window))
-            break;
+            duration.tv_sec = (time_t) wait;
+            duration.tv_nsec = (long) ((wait - (double) duration.tv_sec) * 1e9);
+            thrd_sleep(&duration, NULL);
+            continue;
+        }
 
         // Update particles
-        particle_engine(thread_sync.t, thread_sync.dt);
+        particle_engine(t, (float) (t - t_old));
+        t_old = t;
 
-        // Update frame counter
-        thread_sync.p_frame++;
-
-        // Unlock mutex and signal drawing thread
-        mtx_unlock(&thread_sync.particles_lock);
-        cnd_signal(&thread_sync.p_done);
+        publish_snapshot();
     }
 
     return 0;
@@ -941,7 +1750,7 @@ static int physics_thread_main(void* arg)
 
 int main(int argc, char** argv)
 {
-    int ch, width, height;
+    int ch, i, width, height, worker_count = 0, use_gpu = 0;
     thrd_t physics_thread = 0;
     GLFWwindow* window;
     GLFWmonitor* monitor = NULL;
@@ -952,16 +1761,27 @@ int main(int argc, char** argv)
         exit(EXIT_FAILURE);
     }
 
-    while ((ch = getopt(argc, argv, "fh")) != -1)
+    while ((ch = getopt(argc, argv, "fghj:n:")) != -1)
     {
         switch (ch)
         {
             case 'f':
                 monitor = glfwGetPrimaryMonitor();
                 break;
+            case 'g':
+                use_gpu = 1;
+                break;
             case 'h':
                 usage();
                 exit(EXIT_SUCCESS);
+            case 'j':
+                worker_count = atoi(optarg);
+                break;
+            case 'n':
+                max_particles = atoi(optarg);
+                if (max_particles < 1)
+                    max_particles = 1;
+                break;
         }
     }
 
@@ -1037,24 +1857,58 @@ int main(int argc, char** argv)
     glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
     wireframe = 0;
 
-    // Set initial times
-    thread_sync.t  = 0.0;
-    thread_sync.dt = 0.001f;
-    thread_sync.p_frame = 0;
-    thread_sync.d_frame = 0;
-
-    mtx_init(&thread_sync.particles_lock, mtx_timed);
-    cnd_init(&thread_sync.p_done);
-    cnd_init(&thread_sync.d_done);
+    if (use_gpu && !init_gpu_engine())
+        fprintf(stderr, "Running the particle physics on the CPU\n");
 
-    if (thrd_create(&physics_thread, physics_thread_main, window) != thrd_success)
+    // The GPU engine only makes one step's births at a time in the
+    // particle arrays
+    if (gpu.enabled)
+        particles.capacity = (int) (MIN_DELTA_T / BIRTH_INTERVAL) + 2;
+    else
+        particles.capacity = (max_particles + 7) & ~7;
+
+    particles.x    = calloc(particles.capacity, sizeof(float));
+    particles.y    = calloc(particles.capacity, sizeof(float));
+    particles.z    = calloc(particles.capacity, sizeof(float));
+    particles.vx   = calloc(particles.capacity, sizeof(float));
+    particles.vy   = calloc(particles.capacity, sizeof(float));
+    particles.vz   = calloc(particles.capacity, sizeof(float));
+    particles.rgba = calloc(particles.capacity, sizeof(GLuint));
+    particles.life = calloc(particles.capacity, sizeof(float));
+
+    if (gpu.enabled)
     {
-        glfwTerminate();
-        exit(EXIT_FAILURE);
+        gpu.staging = calloc(particles.capacity,
+                             GPU_STATE_FLOATS * sizeof(float));
+    }
+    else
+    {
+        // Set initial snapshots, none of them fresh
+        for (i = 0;  i < 3;  i++)
+        {
+            thread_sync.snapshots[i].pos = calloc(particles.capacity, sizeof(Vec3));
+            thread_sync.snapshots[i].rgba = calloc(particles.capacity, sizeof(GLuint));
+        }
+
+        thread_sync.front = 0;
+        thread_sync.middle = 1;
+        thread_sync.back = 2;
     }
 
+    // Set initial times
     glfwSetTime(0.0);
 
+    if (!gpu.enabled)
+    {
+        start_workers(worker_count);
+
+        if (thrd_create(&physics_thread, physics_thread_main, window) != thrd_success)
+        {
+            glfwTerminate();
+            exit(EXIT_FAILURE);
+        }
+    }
+
     while (!glfwWindowShouldClose(window))
     {
         draw_scene(window, glfwGetTime());
@@ -1063,7 +1917,11 @@ int main(int argc, char** argv)
         glfwPollEvents();
     }
 
-    thrd_join(physics_thread, NULL);
+    if (!gpu.enabled)
+    {
+        thrd_join(physics_thread, NULL);
+        stop_workers();
+    }
 
     glfwDestroyWindow(window);
     glfwTerminate();